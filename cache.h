@@ -0,0 +1,294 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+/* The engine's own structures, for libcachesim.c. Programs using the library
+only need cachesim.h */
+
+#include "cachesim.h"
+
+/* tags of one set are packed next to each other, so keep them small. Only a
+cache with more than 32 tag bits (from a wide address, see
+cachesim_options.address_bits) stores wide ones */
+typedef uint32_t tag_t;
+typedef uint64_t wide_tag_t;
+
+void bit_extractor_calculator(int*, int*, int*, int, int, int);
+
+/* shifts and masks for pulling the fields out of an address, filled in once
+by decoder_setup from the bit counts bit_extractor_calculator finds */
+struct Decoder
+{
+	int word_shift;
+	int row_shift;
+	int tag_shift;
+	memaddr_t word_mask;
+	memaddr_t row_mask;
+	memaddr_t tag_mask;
+};
+
+void decoder_setup(struct Decoder*, int, int, int);
+
+/* searches one set's packed tags, see select_probe */
+typedef int (*probe_fn)(const tag_t*, const uint64_t*, int, tag_t);
+
+typedef int (*wide_probe_fn)(const wide_tag_t*, const uint64_t*, int, wide_tag_t);
+
+struct Cache;
+
+/* simulates one access to a cache, see access_kernels */
+typedef void (*access_fn)(struct Cache*, AccessType, memaddr_t);
+
+/*
+A replacement policy. Each one keeps set_bytes(ways) bytes of state per set,
+which init clears to the empty-set state. touch is called on every hit and fill
+of way, victim picks the way to kick out of a full set (the access kernels call
+them directly rather than through these pointers). None of them scan the
+set: updates and victim choice are O(1) or O(log ways) (O(ways / 64) for the
+bit-per-way policies). See the replacement policies section of libcachesim.c.
+*/
+struct ReplacementPolicy
+{
+	char letter;	/* how -I/-D name it */
+	const char* name;
+	size_t (*set_bytes)(int ways);
+	void (*init)(void* state, int ways);
+	void (*touch)(struct Cache* cache, void* state, int way);
+	int (*victim)(struct Cache* cache, void* state);
+};
+
+const struct ReplacementPolicy* replacement_policy(ReplacementType);
+
+#define STRIDE_ENTRIES 64	/* regions the stride prefetcher tracks at once */
+#define STREAM_TRACKERS 16	/* streams the stream prefetcher follows at once */
+#define POLLUTION_ENTRIES 1024	/* blocks prefetches kicked out that are remembered */
+
+/* what the stride prefetcher knows about one region */
+struct StrideEntry
+{
+	memaddr_t region;
+	memaddr_t last_block;
+	int64_t stride;
+	int confidence;	/* times in a row the stride repeated */
+	int valid;
+};
+
+struct StreamTracker
+{
+	memaddr_t last_block;
+	int direction;	/* +1, -1, or 0 before there's one */
+	int confidence;	/* steps in a row in that direction */
+	int valid;
+};
+
+/*
+A cache's prefetcher (see the prefetchers section of libcachesim.c). Blocks
+are numbered by address >> decoder.row_shift. prefetched and issued_at are
+carved out of the cache's storage after its other arrays: prefetched is a
+bitmask laid out like valid (brought in by a prefetch, not accessed since),
+issued_at has one entry per block, the clock when it was prefetched. evicted
+remembers (block + 1) of blocks prefetches kicked out, hashed, to spot
+pollution.
+*/
+struct Prefetcher
+{
+	PrefetchInfo info;	/* type NONE if the cache has none */
+	uint32_t latency;
+	uint32_t clock;	/* demand accesses to the cache so far */
+	int region_shift;	/* block number to 4 KB region */
+	uint64_t* prefetched;
+	uint32_t* issued_at;
+	memaddr_t evicted[POLLUTION_ENTRIES];
+	struct StrideEntry strides[STRIDE_ENTRIES];
+	struct StreamTracker streams[STREAM_TRACKERS];
+	int next_stream;	/* the tracker a new stream replaces, round robin */
+};
+
+#define TOP_BLOCKS_MAX 1024
+
+/* an instrumented cache's counters (see the instrumentation section of
+libcachesim.c): SetStats per set, and a space-saving sketch of the top most-
+missing blocks. The sketch's entries are three parallel arrays, top_used of
+them filled. top_heap is a min-heap of entry numbers on misses, top_position
+where each entry is in it, and top_index a hash table from block to entry
+number + 1 (0 if free, index_size slots). All of them are part of the cache's
+storage */
+struct Instrumentation
+{
+	int per_set;	/* keeps sets */
+	struct SetStats* sets;	/* NULL when not instrumented */
+	int top;	/* 0 without the sketch */
+	int top_used;
+	memaddr_t* top_blocks;
+	uint64_t* top_misses;
+	uint64_t* top_errors;
+	int32_t* top_heap;
+	int32_t* top_position;
+	int32_t* top_index;
+	size_t index_size;	/* a power of two, at least twice top */
+};
+
+/* the set 3C classification keeps of the blocks a cache has brought in since
+it was cleared, as a hash table of 64-block groups with a bit per block, so a
+trace's neighbouring blocks share an entry. It grows with them, so it lives
+outside the arena, allocated on its own */
+struct SeenGroup
+{
+	memaddr_t group;	/* block / 64 + 1, 0 if free */
+	uint64_t blocks;
+};
+
+struct SeenBlocks
+{
+	size_t size;	/* groups, a power of two */
+	size_t used;
+	struct SeenGroup* groups;
+};
+
+/* a fully-associative LRU cache of as many blocks as its cache, to tell
+capacity misses from conflict misses (see the miss classification section of
+libcachesim.c). blocks holds the used entries; next and prev link them in
+recency order, with a sentinel at index size, and index is a hash table from
+block to entry + 1 (0 if free, index_size slots). All of them are part of the
+cache's storage */
+struct Shadow
+{
+	int size;	/* blocks, 0 without classification */
+	int used;
+	memaddr_t* blocks;
+	int32_t* next;
+	int32_t* prev;
+	int32_t* index;
+	size_t index_size;	/* a power of two, at least twice size */
+	struct SeenBlocks* seen;	/* shared with cachesim_share views */
+};
+
+/* a time-sampled cache's sums over its finished windows of the accesses a
+and misses m in each, for the confidence interval (see the sampling section
+of libcachesim.c) */
+struct WindowSums
+{
+	uint64_t windows;
+	double accesses;
+	double misses;
+	double accesses_squared;
+	double misses_squared;
+	double products;	/* a * m */
+	uint64_t start_accesses;	/* the counters when the current window began */
+	uint64_t start_misses;
+};
+
+#define VICTIM_MAX_BLOCKS 1024
+#define WRITE_BUFFER_MAX_ENTRIES 1024
+
+struct VictimBlock
+{
+	memaddr_t block;
+	uint32_t age;	/* when it went in, 0 if the entry is empty */
+	int dirty;
+};
+
+/* a small fully-associative cache of the blocks its cache kicked out (see the
+victim cache section of libcachesim.c). blocks is part of the cache's storage */
+struct VictimCache
+{
+	int size;	/* 0 if there's none */
+	uint32_t clock;
+	struct VictimBlock* blocks;
+};
+
+/* stores waiting to go to memory, one entry per block (or 64 words of a bigger
+block): the words of it written, and which one (+ 1, 0 if free) */
+struct BufferEntry
+{
+	memaddr_t unit;
+	uint64_t words;
+};
+
+struct WriteBuffer
+{
+	int size;	/* 0 if there's none */
+	int next;	/* the entry the next new unit replaces, oldest first */
+	int unit_shift;	/* address to unit */
+	memaddr_t unit_mask;
+	memaddr_t word_mask;	/* word of the unit */
+	struct BufferEntry* entries;	/* part of the cache's storage */
+};
+
+/*
+One cache level, stored structure-of-arrays. The same layout covers
+direct-mapped (ways == 1), set-associative and fully-associative
+(num_sets == 1) caches.
+
+tags have one entry per block, indexed row * ways + way; a wide cache uses
+wide_tags and wide_probe instead of tags and probe.
+valid and dirty are bitmasks, mask_words 64-bit words per set.
+repl_state holds the replacement policy's state, repl_stride bytes per set
+(none for direct-mapped caches, which have no choice to make).
+All four arrays, and those of a prefetcher, victim cache, write buffer,
+instrumentation or shadow cache, are carved out of the one 64-byte-aligned
+block at storage, which is part of the handle's arena.
+*/
+struct Cache
+{
+	int num_sets;
+	int ways;
+	int words_per_block;
+	int mask_words;
+	ReplacementType replacement;
+	WriteScheme write_scheme;
+	AllocateType allocate_scheme;
+	struct Decoder decoder;
+	int wide;	/* tags are wide_tag_t */
+	union {
+		probe_fn probe;
+		wide_probe_fn wide_probe;
+	};
+	access_fn access;
+	union {
+		tag_t* tags;
+		wide_tag_t* wide_tags;
+	};
+	uint64_t* valid;
+	uint64_t* dirty;
+	const struct ReplacementPolicy* policy;
+	unsigned char* repl_state;
+	size_t repl_stride;
+	uint64_t rng[4];	/* xoshiro256** state for random replacement */
+	void* storage;
+	size_t storage_size;
+	struct Stats stats;
+	struct Prefetcher pf;
+	struct VictimCache victim;
+	struct WriteBuffer wbuf;
+	struct Instrumentation inst;
+	struct Shadow shadow;
+	int sample_limit;	/* set sampling: sets whose scrambled index is below it are simulated, 0 for all */
+	struct WindowSums windows;
+};
+
+const char* cache_setup(struct Cache*, const CacheInfo*, const struct cachesim_options*, int);
+
+void cache_place(struct Cache*, void*);
+
+void cache_clear(struct Cache*);
+
+void cache_seed(struct Cache*, uint64_t);
+
+/* what a cachesim_t handle is */
+struct cachesim
+{
+	struct Cache icache;
+	struct Cache dcache;
+	uint64_t seed;
+	void* arena;	/* both caches' storage, one mapping */
+	size_t arena_size;	/* what the caches use of it */
+	size_t arena_mapped;	/* rounded up to whole (huge) pages */
+	const char* backing;	/* what kind of pages it got */
+	cachesim_t* owner;	/* for a cachesim_share view, the handle it shares; else NULL */
+	uint64_t sample_window;	/* time sampling, see cachesim_options; period 0 if none */
+	uint64_t sample_period;
+	uint64_t sample_warmup;
+	uint64_t clock;	/* accesses so far, which part of the period it's in */
+};
+
+#endif
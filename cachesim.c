@@ -1,10 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "cachesim.h"
 
 /*
+Build:
+make
+
+This builds the cachesim command and the simulator on its own as a library,
+libcachesim.a and libcachesim.so, whose interface is in cachesim.h.
+
 Usage:
 ./cachesim -I 4096:1:2:R -D 1:4096:2:4:R:B:A -D 2:16384:4:8:L:T:N trace.txt
 
@@ -13,8 +25,10 @@ The -I flag sets instruction cache parameters. The parameter after looks like:
 This means the I-cache will have 4096 blocks, 1 word per block, with 2-way
 associativity.
 
-The R means Random block replacement; L for that item would mean LRU. This
-replacement scheme is ignored if the associativity == 1.
+The R means Random block replacement; L for that item would mean LRU. The
+pseudo-LRU schemes real hardware uses are there too: P for tree pseudo-LRU, N
+for NRU (not recently used) and B for bit pseudo-LRU. This replacement scheme
+is ignored if the associativity == 1.
 
 The -D flag sets data cache parameters. The parameter after looks like:
 1:4096:2:4:R:B:A
@@ -37,7 +51,146 @@ The last argument is the filename of the memory trace to read. This is a text
 file where every line is of the form:
 0x00000000 R
 A hexadecimal address, followed by a space and then R, W, or I for data read,
-data write, or instruction fetch, respectively.
+data write, or instruction fetch, respectively. Addresses are 32 bits wide
+unless --address-bits 48 or --address-bits 64 says otherwise; bits above the
+width are ignored. Tags are stored in 32 bits when they fit and 64 otherwise. Regular files are memory-mapped
+and scanned in place; a filename of - reads the trace from stdin instead.
+
+--stats=json prints the statistics as JSON instead of text: an array with an
+object for each configuration, giving each cache's parameters, every counter
+(64-bit), and the miss rates, misses per thousand instructions (counting an
+instruction per I-cache read) and bytes of memory traffic worked out from them.
+--stats=text is the default.
+
+--trace-stats prints how fast the trace was read (MB/s and lines/s) to stderr.
+--parse-only reads and checks the trace without simulating it, which gives the
+parser's throughput on its own.
+
+The trace can also be a binary trace (see cachesim.h), which is recognised by
+its magic bytes. Make one from a text trace with:
+./cachesim convert trace.txt trace.cstb
+
+Traces compressed with gzip, zstd, xz or zip are read directly, streamed through
+the decompressor without unpacking them to disk. Name one trace in a zip
+archive with archive.zip:member, for example traces1.zip:k6.txt. Binary and
+compressed traces can come through stdin or a pipe too, all but zip archives,
+which have to be files.
+
+--sweep configs.txt simulates many configurations in one pass over the trace,
+in place of -I and -D. Each line of the file is one configuration written with
+the same -I/-D parameters, # starts a comment:
+-I 4096:1:2:R -D 1:4096:2:4:R:B:A
+-I 4096:1:4:L -D 1:8192:2:4:L:T:N
+The trace is read once and every configuration gets its own statistics block.
+--threads N runs the configurations of a sweep on N threads (0 means one per
+core). The trace is loaded into memory once and shared by all of them; the
+results are the same as with one thread. With a single configuration, the
+threads split the cache's sets between them instead, and again the results are
+the same as a serial run (a configuration with random replacement runs on one
+thread, since its evictions depend on the order of the whole trace).
+
+--seed N seeds the generators random replacement draws from, 0 by default.
+Every cache has its own, seeded from N alone, so a run is reproducible bit for
+bit whatever else is in the sweep and however many threads it runs on.
+
+Associative sets are searched with SSE2, AVX2 or AVX-512 compares when the CPU
+has them. --simd scalar|sse2|avx2|avx512 forces one kernel (falling back to
+scalar where it doesn't fit the set or the CPU), --simd auto is the default.
+
+Each configuration keeps all its cache metadata (tags, valid and dirty bits,
+replacement state) in one memory mapping, backed by huge pages when it is big
+enough and the system has them. --footprint prints its size in bytes, and what
+pages it got, after the statistics; --small-pages sticks to normal pages.
+
+--prefetch-i KIND and --prefetch-d KIND attach a hardware prefetcher to the
+I-cache and the L1 D-cache of every configuration. KIND is next (the blocks
+after a miss), stride (a repeating stride within a 4 KB region) or stream
+(sequential runs, up or down), optionally followed by :DEGREE and :DISTANCE,
+for example stream:4:2; degree is how many blocks it fetches at once, distance
+how far ahead the first one is, both 1 by default. The statistics then count
+prefetches issued, useful (accessed before being kicked out), late (accessed
+within --prefetch-latency N accesses of being issued, 32 by default) and
+polluting (misses on blocks a prefetch kicked out). Prefetchers fill other
+sets than the one accessed, so with one -I/-D configuration they run on one
+thread.
+
+--victim N puts a fully-associative victim cache of N blocks behind the L1
+D-cache: blocks the D-cache kicks out go there, and a miss that finds its block
+there gets it back without reading memory (it still counts as a miss). --wbuf N
+gives the D-cache a write buffer of N blocks, which merges the words that stores
+write through or around the cache by block, so a word stored again while it is
+still waiting is written to memory once. The statistics then count victim cache
+hits and stores merged in the write buffer. Both are shared by all the sets,
+so like prefetchers they keep a single configuration on one thread.
+
+--heatmap FILE writes per-set counters for every cache of every configuration:
+accesses, hits, misses and evictions. Keeping them costs one counter increment
+per access (and a few per miss). --hot-blocks FILE writes the addresses of the
+blocks that missed most in each cache, with their miss counts and how much
+each count may be over. They come from a space-saving sketch of --top K blocks,
+32 by default, which costs O(log K) per miss; any block behind more than 1/K
+of a cache's misses is in it. Either file is JSON if its name ends in .json,
+and CSV otherwise. The sketch is shared by all the sets, so like prefetchers
+it keeps a single configuration on one thread.
+
+By default a miss that fills an empty way counts as compulsory and one that
+kicks a block out as a conflict miss. --3c classifies misses properly instead:
+compulsory misses are the first on each block, capacity misses the ones a
+fully-associative LRU cache of the same size would also have had, and conflict
+misses the rest, and the statistics gain a capacity miss count. Every cache then
+keeps such a shadow cache, updated on every access, and the set of blocks it
+has seen, which grows with the distinct blocks in the trace: a bit for each,
+and 32 bytes or so for each 64 neighbouring blocks.
+The shadow cache spans all the sets, so a single configuration runs on one
+thread.
+
+For a quick answer from a huge trace, simulate a sample of it. --sample-sets N
+simulates only 1 in N (a power of two) of each cache's sets, picked scattered
+over the cache; the other sets' accesses are dropped before any tag is looked
+at. --time-sample W:P[:U] cuts the trace into periods of P accesses and counts
+only the last W of each, the window; the U accesses before it are simulated
+without being counted, to warm the caches, and the rest are skipped. U is
+P - W by default, which warms the caches with everything outside the windows:
+the cache contents are then exact, but the time saved is only the counting.
+Sampled statistics count only the sample, and each cache gets an estimated
+miss rate with a 95% confidence interval, from the spread of the miss rate
+over the sampled sets or windows. The interval is too narrow when a few sets
+take a big share of the accesses. Time sampling keeps a single configuration
+on one thread.
+
+--checkpoint FILE saves the whole simulator state at the end of the run (cache
+contents, replacement and generator state, counters, and how far into the trace
+it got) and --restore FILE starts a run from one, with the same -I/-D and
+options, picking the trace up where the checkpoint left it. --stop-after N ends
+the run after N accesses (counting from the restored position). So a long
+warm-up can be simulated once:
+./cachesim -I ... -D ... --stop-after 100000000 --checkpoint warm.ckpt trace
+and any number of short runs started from it:
+./cachesim -I ... -D ... --restore warm.ckpt --stop-after 1000000 trace
+The counters carry on from the checkpoint's. A restored run still reads the
+trace up to the position, but doesn't simulate it, and the cache arrays are
+mapped straight from the checkpoint file. The checkpoint keeps a hash of every
+access up to its position, so restoring with another trace (or one that ends
+too soon) is an error, while the same trace in another format (text, binary or
+compressed) is fine. Checkpoints take a single -I/-D configuration, and are
+only good for the build that wrote them.
+
+--intervals FILE writes how much every counter of every cache went up over
+each --interval N accesses (1000000 by default; Ni counts N instruction
+fetches instead), with the miss rate and misses per thousand instructions over
+it, one row per cache per interval, as the trace goes, so phases
+of a program that the totals average away show up: a CSV file, or JSON lines
+if the name ends in .json or .jsonl. --warmup N simulates the first N accesses
+without counting them: the counters (and the heatmap, hot blocks and samples)
+start from zero after them, with the caches warm, and intervals start there.
+Neither takes more than a compare per access, but they keep everything on one
+thread, and don't go with --mrc, nor --warmup with --time-sample, which warms
+its windows up itself.
+
+--mrc skips the -I/-D caches and prints LRU miss-ratio curves for the I- and
+D-streams instead, as CSV, for every block size from 1 to 16 words, set count
+from 1 to 4096 and associativity from 1 to 32 ways, plus fully-associative
+caches up to 65536 blocks. It takes one pass over the trace.
 */
 
 /* These global variables will hold the info needed to set up your caches in
@@ -46,758 +199,1830 @@ CacheInfo struct for docs on what's inside it. Have a look at dump_cache_info
 for an example of how to check the members. */
 static CacheInfo icache_info;
 static CacheInfo dcache_info[3];
-struct Block block;
-struct Wrapper wrapper;
-struct Wrapper d_wrapper;
-int byte_bits;
-int data_size;
-int tag_bits;
-int word_bits;
-int row_bits;
-int d_tag_bits;
-int d_word_bits;
-int d_row_bits;
-int compulsory_miss = 0;
-int d_compulsory_miss = 0;
-char binary[8][5];
-char binary_address[32];
-int cache_size;
-int d_cache_size;
-int mem_reads = 0;
-int d_mem_reads = 0;
-int d_mem_writes = 0;
-int conflict_miss = 0;
-int d_conflict_miss = 0;
-int wpb;
-int read_cache = 0;
-int d_read_cache = 0;
-float miss_rate = 0.0;
-float d_miss_rate = 0.0;
-int associativity;
-int d_associativity;
-int d_wpb;
-int writes_to_cache = 0;
-int words_written_to_mem = 0;
-AllocateType a_type;
-WriteScheme w_scheme;
+
+/* one configuration to simulate, and the handle simulating it */
+struct Simulator
+{
+	CacheInfo icache_info;
+	CacheInfo dcache_info[3];
+	cachesim_t* sim;
+	char* name;	/* the sweep line it came from, NULL for a plain run */
+};
+
+/* every configuration being simulated: the one from -I/-D, or one per line
+of a --sweep file */
+struct Simulator* simulators = NULL;
+int num_simulators = 0;
+static int sweep_line = 0;
+static struct cachesim_options sim_options;	/* --seed, --simd, --small-pages, --address-bits, --prefetch-*, --victim, --wbuf, --top, --3c, --sample-sets, --time-sample */
+static int report_footprint = 0;	/* --footprint */
+static int stats_json = 0;	/* --stats=json */
+static FILE* heatmap_file = NULL;	/* --heatmap */
+static FILE* hot_blocks_file = NULL;	/* --hot-blocks */
+static FILE* interval_file = NULL;	/* --intervals */
+static int interval_json = 0;
+static uint64_t interval_length = 1000000;	/* --interval */
+static int interval_instructions = 0;	/* counts --interval in instruction fetches */
+static uint64_t warmup_accesses = 0;	/* --warmup */
+static const char* checkpoint_file = NULL;	/* --checkpoint */
+static const char* restore_file = NULL;	/* --restore */
+static uint64_t stop_after = 0;	/* --stop-after, 0 for the whole trace */
+static int heatmap_json = 0;
+static int hot_blocks_json = 0;
+static int top_blocks = 32;	/* --top */
+
+static void bad_params(const char* msg);
+
+/* adds a configuration to simulate, name is what to call it in the output */
+void add_simulator(const CacheInfo* icache_info, const CacheInfo* dcache_info, char* name) {
+	struct Simulator* sim;
+
+	simulators = realloc(simulators, sizeof(struct Simulator) * (num_simulators + 1));
+	sim = &simulators[num_simulators++];
+	memset(sim, 0, sizeof(*sim));
+	sim->icache_info = *icache_info;
+	memcpy(sim->dcache_info, dcache_info, sizeof(sim->dcache_info));
+	sim->name = name;
+}
+
+void setup_simulator(struct Simulator* sim) {
+	const char* error;
+
+	sim->sim = cachesim_create(&sim->icache_info, sim->dcache_info, &sim_options, &error);
+	if( sim->sim == NULL ) {
+		if( sim->name != NULL ) {
+			fprintf(stderr, "%s: ", sim->name);
+		}
+		bad_params(error);
+	}
+}
 
 void setup_caches()
 {
 	/* Set up your caches here! */
+	if( num_simulators == 0 ) {
+		add_simulator(&icache_info, dcache_info, NULL);
 
-	/* Setting up I-Cache *************************************************************/
-	int num_blocks = icache_info.num_blocks;
-	int words_per_block = icache_info.words_per_block;
-	associativity = icache_info.associativity;
-	wpb = words_per_block;
+		/* This call to dump_cache_info is just to show some debugging information
+		and you may remove it. */
+		if( !stats_json ) {
+			dump_cache_info();
+		}
+	}
 
-	srand(num_blocks);
+	for( int i = 0; i < num_simulators; i++ ) {
+		setup_simulator(&simulators[i]);
+	}
+}
 
-	/* direct-mapped cache setup */
-	if( associativity == 1 ) {
 
-		if( num_blocks != 0 ) {
+/* Stack distance analysis *****************************************************/
 
-			bit_extractor_calculator(&word_bits, &tag_bits, &row_bits, words_per_block, num_blocks);
+/* ranges --mrc covers: block sizes 1..2^(MRC_BLOCK_SIZES-1) words,
+2^0..2^MRC_SET_BITS sets, 2^0..2^MRC_WAYS_BITS ways, and fully-associative
+caches of up to 2^MRC_FULL_BITS blocks */
+#define MRC_BLOCK_SIZES 5
+#define MRC_SET_BITS 12
+#define MRC_WAYS_BITS 5
+#define MRC_FULL_BITS 16
 
-			wrapper.cache = (struct Block *)malloc(sizeof(struct Block)*num_blocks);
-			for( int i = 0; i < num_blocks; i++ ) {
-				wrapper.cache[i].tag_bits = '\0';
-			}
-			cache_size = num_blocks;
+/*
+--mrc computes LRU miss-ratio curves for every cache size in one pass
+(Mattson's stack algorithm). An LRU cache with A ways hits an access exactly
+when fewer than A other blocks of the same set were touched since the last
+access to its block; that count is the access's stack distance. So a histogram
+of stack distances, kept for each block size and set count, gives the miss
+ratio of every associativity at once.
+
+Distances are counted with one Fenwick tree per set over that set's access
+times: a block's last access time holds a 1, so the distance is the number of
+1s after it. When a set's timeline fills up it is compacted down to the blocks
+still in it, so memory follows the number of distinct blocks, not trace length.
+*/
+
+/* one set's timeline */
+struct FenwickSet
+{
+	uint32_t* tree;		/* Fenwick tree over times 1..capacity */
+	uint32_t* owner;	/* block id whose access is at each time */
+	uint32_t capacity;
+	uint32_t next;		/* next time to hand out */
+	uint32_t live;		/* distinct blocks in the set */
+};
+
+/* everything for one set count */
+struct StackLevel
+{
+	uint32_t* last;		/* set-local time of each block id's last access, 0 if none */
+	struct FenwickSet* sets;
+	uint64_t histogram[34];	/* by bit length of the distance */
+};
+
+/* one access stream (instruction or data) at one block size */
+struct ReuseStream
+{
+	int block_shift;	/* byte address -> block address */
+	memaddr_t* keys;	/* block address + 1 per hash slot, 0 if empty */
+	uint32_t* ids;
+	size_t hash_size;
+	uint32_t num_ids;
+	uint32_t id_capacity;
+	uint64_t accesses;
+	uint64_t cold;
+	struct StackLevel levels[MRC_SET_BITS + 1];
+};
+
+static struct ReuseStream* reuse_streams = NULL;	/* [stream][block size] */
+static int mrc_mode = 0;
+
+static void fenwick_add(struct FenwickSet* set, uint32_t time, int32_t value) {
+	for( ; time <= set->capacity; time += time & -time ) {
+		set->tree[time] += value;
+	}
+}
+
+static uint32_t fenwick_prefix(const struct FenwickSet* set, uint32_t time) {
+	uint32_t sum = 0;
+	for( ; time > 0; time -= time & -time ) {
+		sum += set->tree[time];
+	}
+	return sum;
+}
+
+/* renumbers the blocks still in a set to times 1..live, doubling the room
+if the set is more than half full */
+static void fenwick_compact(struct FenwickSet* set, uint32_t* last) {
+	uint32_t live = 0;
+	uint32_t capacity = set->capacity;
+
+	for( uint32_t time = 1; time < set->next; time++ ) {
+		uint32_t id = set->owner[time];
+		if( last[id] == time ) {
+			set->owner[++live] = id;
+			last[id] = live;
 		}
-	} else {	//not direct-mapped setup
+	}
 
-		if( num_blocks != 0 ) {
+	if( capacity < 16 || live * 2 > capacity ) {
+		capacity = capacity < 16 ? 16 : capacity * 2;
+		set->tree = realloc(set->tree, sizeof(uint32_t) * (capacity + 1));
+		set->owner = realloc(set->owner, sizeof(uint32_t) * (capacity + 1));
+		set->capacity = capacity;
+	}
 
-			bit_extractor_calculator(&word_bits, &tag_bits, &row_bits, words_per_block, num_blocks);
+	/* every time up to live is occupied, build the tree in O(n) */
+	memset(set->tree, 0, sizeof(uint32_t) * (capacity + 1));
+	for( uint32_t time = 1; time <= capacity; time++ ) {
+		uint32_t parent = time + (time & -time);
+		set->tree[time] += (time <= live);
+		if( parent <= capacity ) {
+			set->tree[parent] += set->tree[time];
+		}
+	}
+	set->next = live + 1;
+}
 
-			wrapper.cache2D = (struct Block **)malloc(sizeof(struct Block)*num_blocks*associativity);
-			for( int i = 0; i < num_blocks; i++ ) {
-				wrapper.cache2D[i] = (struct Block*)malloc(sizeof(struct Block)*associativity);
-				for( int j = 0; j < associativity; j++ ) {
-					wrapper.cache2D[i][j].tag_bits = '\0';
-					wrapper.cache2D[i][j].used_last = 0;
+/* finds the dense id of a block, handing out a new one the first time */
+static uint32_t reuse_block_id(struct ReuseStream* stream, memaddr_t block, int* first) {
+	size_t mask, slot;
+
+	if( 2 * (size_t)stream->num_ids >= stream->hash_size ) {	// grow the table
+		size_t old_size = stream->hash_size;
+		memaddr_t* old_keys = stream->keys;
+		uint32_t* old_ids = stream->ids;
+
+		stream->hash_size = old_size ? old_size * 2 : 1024;
+		stream->keys = calloc(stream->hash_size, sizeof(memaddr_t));
+		stream->ids = malloc(stream->hash_size * sizeof(uint32_t));
+		for( size_t i = 0; i < old_size; i++ ) {
+			if( old_keys[i] != 0 ) {
+				slot = (old_keys[i] * 0x9e3779b97f4a7c15ull) & (stream->hash_size - 1);
+				while( stream->keys[slot] != 0 ) {
+					slot = (slot + 1) & (stream->hash_size - 1);
 				}
+				stream->keys[slot] = old_keys[i];
+				stream->ids[slot] = old_ids[i];
 			}
-			cache_size = num_blocks;
 		}
+		free(old_keys);
+		free(old_ids);
+	}
+
+	mask = stream->hash_size - 1;
+	slot = ((block + 1) * 0x9e3779b97f4a7c15ull) & mask;
+	while( stream->keys[slot] != 0 ) {
+		if( stream->keys[slot] == block + 1 ) {
+			*first = 0;
+			return stream->ids[slot];
+		}
+		slot = (slot + 1) & mask;
 	}
-	/*******************************************************************************/
-	// d-cache-Level 1
-	int d_num_blocks = dcache_info[0].num_blocks;
-	int d_words_per_block = dcache_info[0].words_per_block;
-	d_associativity = dcache_info[0].associativity;
-	a_type = dcache_info[0].allocate_scheme;
-	w_scheme = dcache_info[0].write_scheme;
-	d_wpb = d_words_per_block;
 
-	if( d_associativity == 1 ) {
+	if( stream->num_ids == stream->id_capacity ) {
+		uint32_t capacity = stream->id_capacity ? stream->id_capacity * 2 : 1024;
+		for( int level = 0; level <= MRC_SET_BITS; level++ ) {
+			uint32_t** last = &stream->levels[level].last;
+			*last = realloc(*last, sizeof(uint32_t) * capacity);
+			memset(*last + stream->id_capacity, 0, sizeof(uint32_t) * (capacity - stream->id_capacity));
+		}
+		stream->id_capacity = capacity;
+	}
 
-		if( d_num_blocks != 0 ) {
+	stream->keys[slot] = block + 1;
+	stream->ids[slot] = stream->num_ids;
+	*first = 1;
+	return stream->num_ids++;
+}
 
-			bit_extractor_calculator(&d_word_bits, &d_tag_bits, &d_row_bits, d_words_per_block, d_num_blocks);
+static void stack_distance_access(struct ReuseStream* stream, memaddr_t address) {
+	memaddr_t block = address >> stream->block_shift;
+	int first;
+	uint32_t id = reuse_block_id(stream, block, &first);
 
-			d_wrapper.cache = (struct Block *)malloc(sizeof(struct Block)*d_num_blocks);
-			for( int i = 0; i < d_num_blocks; i++ ) {
-				d_wrapper.cache[i].tag_bits = '\0';
-			}
-			d_cache_size = d_num_blocks;
+	stream->accesses++;
+	stream->cold += first;
+
+	for( int level = 0; level <= MRC_SET_BITS; level++ ) {
+		struct StackLevel* stack = &stream->levels[level];
+		struct FenwickSet* set = &stack->sets[block & (((memaddr_t)1 << level) - 1)];
+		uint32_t time = stack->last[id];
+
+		if( time != 0 ) {
+			uint32_t distance = set->live - fenwick_prefix(set, time);
+			stack->histogram[distance ? 32 - __builtin_clz(distance) : 0]++;
+			fenwick_add(set, time, -1);
+			stack->last[id] = 0;	// so compaction doesn't keep the old time
+		} else {
+			set->live++;
 		}
-	} else {	//not direct-mapped setup
 
-		if( d_num_blocks != 0 ) {
+		if( set->next > set->capacity ) {
+			fenwick_compact(set, stack->last);
+		}
+		time = set->next++;
+		set->owner[time] = id;
+		stack->last[id] = time;
+		fenwick_add(set, time, 1);
+	}
+}
 
-			bit_extractor_calculator(&d_word_bits, &d_tag_bits, &d_row_bits, d_words_per_block, d_num_blocks);
+/* access_handler for --mrc */
+static memaddr_t mrc_address_mask;	/* the address width the caches would see */
 
-			d_wrapper.cache2D = (struct Block **)malloc(sizeof(struct Block)*d_num_blocks*d_associativity);
-			for( int i = 0; i < d_num_blocks; i++ ) {
-				d_wrapper.cache2D[i] = (struct Block*)malloc(sizeof(struct Block)*d_associativity);
-				for( int j = 0; j < d_associativity; j++ ) {
-					d_wrapper.cache2D[i][j].tag_bits = '\0';
-					d_wrapper.cache2D[i][j].used_last = 0;
-				}
+static void mrc_access(AccessType type, memaddr_t address) {
+	int stream = (type != Access_I_FETCH);
+	address &= mrc_address_mask;
+	for( int words = 0; words < MRC_BLOCK_SIZES; words++ ) {
+		stack_distance_access(&reuse_streams[stream * MRC_BLOCK_SIZES + words], address);
+	}
+}
+
+void setup_mrc() {
+	int address_bits = sim_options.address_bits ? sim_options.address_bits : 32;
+
+	mrc_address_mask = address_bits < 64 ? ((memaddr_t)1 << address_bits) - 1 : ~(memaddr_t)0;
+	reuse_streams = calloc(2 * MRC_BLOCK_SIZES, sizeof(struct ReuseStream));
+	for( int i = 0; i < 2 * MRC_BLOCK_SIZES; i++ ) {
+		struct ReuseStream* stream = &reuse_streams[i];
+		stream->block_shift = 2 + i % MRC_BLOCK_SIZES;
+		for( int level = 0; level <= MRC_SET_BITS; level++ ) {
+			stream->levels[level].sets = calloc((size_t)1 << level, sizeof(struct FenwickSet));
+			for( size_t set = 0; set < ((size_t)1 << level); set++ ) {
+				stream->levels[level].sets[set].next = 1;	// times start at 1
 			}
-			d_cache_size = d_num_blocks;
 		}
 	}
+}
 
-	/* This call to dump_cache_info is just to show some debugging information
-	and you may remove it. */
-	dump_cache_info();
+/* misses of an LRU cache with 2^ways_bits ways, from a set count's histogram */
+static uint64_t stack_misses(const struct ReuseStream* stream, int level, int ways_bits) {
+	uint64_t misses = stream->cold;
+	for( int bucket = ways_bits + 1; bucket < 34; bucket++ ) {
+		misses += stream->levels[level].histogram[bucket];
+	}
+	return misses;
 }
 
-/* calculates size of the of all the bits for row, word, and tag */
-void bit_extractor_calculator(int* word_bits, int* tag_bits, int* row_bits, int words_per_block, int num_blocks) {
-	int address_size = 32;
+/*
+Prints the miss-ratio curves as CSV. Each (stream, words_per_block,
+associativity) is one curve over num_blocks; associativity "full" is the
+fully-associative curve. Misses count every access to a block not in the
+cache, reads and writes alike, as if every write allocated.
+*/
+void print_mrc() {
+	printf("stream,words_per_block,associativity,num_blocks,miss_ratio\n");
+	for( int i = 0; i < 2 * MRC_BLOCK_SIZES; i++ ) {
+		const struct ReuseStream* stream = &reuse_streams[i];
+		const char* name = i < MRC_BLOCK_SIZES ? "I" : "D";
+		int words = 1 << (i % MRC_BLOCK_SIZES);
+
+		if( stream->accesses == 0 ) {
+			continue;
+		}
+		for( int ways_bits = 0; ways_bits <= MRC_WAYS_BITS; ways_bits++ ) {
+			for( int level = 0; level <= MRC_SET_BITS; level++ ) {
+				printf("%s,%d,%d,%d,%.6f\n", name, words, 1 << ways_bits, 1 << (level + ways_bits),
+					(double)stack_misses(stream, level, ways_bits) / stream->accesses);
+			}
+		}
+		for( int blocks_bits = 0; blocks_bits <= MRC_FULL_BITS; blocks_bits++ ) {
+			printf("%s,%d,full,%d,%.6f\n", name, words, 1 << blocks_bits,
+				(double)stack_misses(stream, 0, blocks_bits) / stream->accesses);
+		}
+	}
+}
 
-	*row_bits = (int)ceil(log(num_blocks)/log(2));	/* calculates how many bits are needed to find each row */
+/* accesses parsed from the trace wait here until there are enough of them to
+run through every configuration in one go */
+#define ACCESS_BATCH_SIZE 4096
 
-	*word_bits = (int)ceil(log(words_per_block)/log(2));	/* number of bits needed for word indexing */
+static struct Access access_batch[ACCESS_BATCH_SIZE];
+static size_t access_batch_count = 0;
 
-	*tag_bits = address_size - *row_bits - *word_bits - 2;
+/* runs the waiting accesses through each configuration in turn, so one
+configuration's cache stays hot in the host's caches for the whole batch */
+void simulate_batch() {
+	for( int i = 0; i < num_simulators; i++ ) {
+		cachesim_access_batch(simulators[i].sim, access_batch, access_batch_count);
+	}
+	access_batch_count = 0;
 }
 
-void hex_binary_converter(memaddr_t address, char** binary, char * binary_address) {
-	/* turn every hex character into 4 binary bits */
-	char* temp;
-	for( int i = 0; i < 8; i++ ) {
-		switch( address % 16 ) {	/* switch lsb */
-			case 0:
-			temp = "0000";
-			binary[i] = temp;
-			break;
-			case 1:
-			temp = "0001";
-			binary[i] = temp;
-			break;
-			case 2:
-			temp = "0010";
-			binary[i] = temp;
-			break;
-			case 3:
-			temp = "0011";
-			binary[i] = temp;
-			break;
-			case 4:
-			temp = "0100";
-			binary[i] = temp;
-			break;
-			case 5:
-			temp = "0101";
-			binary[i] = temp;
-			break;
-			case 6:
-			temp = "0110";
-			binary[i] = temp;
-			break;
-			case 7:
-			temp = "0111";
-			binary[i] = temp;
-			break;
-			case 8:
-			temp = "1000";
-			binary[i] = temp;
-			break;
-			case 9:
-			temp = "1001";
-			binary[i] = temp;
-			break;
-			case 10:
-			temp = "1010";
-			binary[i] = temp;
-			break;
-			case 11:
-			temp = "1011";
-			binary[i] = temp;
-			break;
-			case 12:
-			temp = "1100";
-			binary[i] = temp;
-			break;
-			case 13:
-			temp = "1101";
-			binary[i] = temp;
-			break;
-			case 14:
-			temp = "1110";
-			binary[i] = temp;
-			break;
-			case 15:
-			temp = "1111";
-			binary[i] = temp;
-			break;
+static void batch_access(AccessType type, memaddr_t address) {
+	access_batch[access_batch_count].address = address;
+	access_batch[access_batch_count].type = type;
+	if( ++access_batch_count == ACCESS_BATCH_SIZE ) {
+		simulate_batch();
+	}
+}
+
+/* Parallel sweeps *************************************************************/
+
+/*
+With --threads the whole trace is parsed once into trace_accesses, which every
+thread then reads without locking. Each configuration is a task that runs the
+whole trace through its own cachesim_t, so threads share nothing they
+write and the numbers come out the same as a serial run.
+
+Tasks are dealt out in contiguous runs, one run per worker. A worker takes
+from the back of its own run and, once that is empty, steals from the front of
+someone else's, so a few slow configurations (big fully-associative ones, say)
+don't leave the other cores idle at the end.
+*/
+
+struct Worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int head;	/* this worker's tasks are sweep_tasks[head..tail) */
+	int tail;
+	int id;
+};
+
+static int num_threads = 1;
+static struct Access* trace_accesses = NULL;
+static size_t trace_length = 0;
+static size_t trace_capacity = 0;
+static struct Worker* workers = NULL;
+static int num_workers = 0;
+
+/* access_handler when the trace is loaded up front */
+static void record_access(AccessType type, memaddr_t address) {
+	if( trace_length == trace_capacity ) {
+		trace_capacity = trace_capacity ? trace_capacity * 2 : 1 << 20;
+		trace_accesses = realloc(trace_accesses, sizeof(struct Access) * trace_capacity);
+		if( trace_accesses == NULL ) {
+			fprintf(stderr, "Out of memory loading the trace.\n");
+			exit(1);
 		}
-		address = address/16;
 	}
+	trace_accesses[trace_length].address = address;
+	trace_accesses[trace_length].type = type;
+	trace_length++;
+}
+
+/* next configuration for a worker to run, or -1 when there are none left */
+static int take_task(struct Worker* self) {
+	int task = -1;
+
+	pthread_mutex_lock(&self->lock);
+	if( self->head < self->tail ) {
+		task = --self->tail;
+	}
+	pthread_mutex_unlock(&self->lock);
 
-	//take the binary[8][5] array and convert to a binary_address[32]
-	int z = 0;
-	for( int i = 0; i < 8; i++ ) {
-		for( int j = 3; j >= 0; j-- ) {
-			binary_address[z] = binary[i][j];
-			//printf("binary_address[%d]: %c\n", z, binary_address[z]);
-			z++;
+	for( int i = 1; task < 0 && i < num_workers; i++ ) {
+		struct Worker* victim = &workers[(self->id + i) % num_workers];
+		pthread_mutex_lock(&victim->lock);
+		if( victim->head < victim->tail ) {
+			task = victim->head++;
 		}
+		pthread_mutex_unlock(&victim->lock);
 	}
+	return task;
 }
 
-/*
-fills an array with the appropriate bits
-fills array based on precalculated index and char index
-*/
-void address_decompress(char index, char* array_to_fill, char* binary_address) {
-	int j = 0;
-	int stop;
-	switch(index)
-	{
-		case 'r':
-		stop = 32-tag_bits-row_bits-1;
-		for( int i = 32-tag_bits; i > stop; i-- ) {
-			array_to_fill[j] = binary_address[i];
-			//printf("row bit %d: %c\n", j, array_to_fill[j]);
-			j++;
-		}
-		array_to_fill[stop] = '\0';
-		//printf("row length %d\n", row_bits);
-		break;
-		case 't':
-		stop = 32-tag_bits-1;
-		for( int i = 31; i > stop; i-- ) {
-			array_to_fill[j] = binary_address[i];
-			//printf("tag bit %d: %c\n", j, array_to_fill[j]);
-			j++;
-		}
-		array_to_fill[stop] = '\0';
-		//printf("tag length %d\n", tag_bits);
-		break;
-		case 'w':
-		stop = 1;
-		for( int i = 1+word_bits; i > stop; i-- ) {
-			array_to_fill[j] = binary_address[i];
-			//printf("word bit %d: %c\n", j, array_to_fill[j]);
-			j++;
-		}
-		array_to_fill[stop] = '\0';
-		//printf("word length %d\n", word_bits);
-		break;
+static void* sweep_worker(void* arg) {
+	struct Worker* self = arg;
+	int task;
+
+	while( (task = take_task(self)) >= 0 ) {
+		cachesim_access_batch(simulators[task].sim, trace_accesses, trace_length);
 	}
+	return NULL;
 }
 
-//converts row array into an int index
-int row_index_converter(char* row) {
-	int row_index = 0;
-	int base = 2;
-	int position = 0;
-	//max row index size = 2^row_bits
-	for( int i = row_bits; i > 0; i-- ) {
-		//printf("row[i]: %c\n", row[i]);
-		if( row[i] == '1') {
-			row_index += ( 1 * pow(base, position) );
+/* runs every configuration over the loaded trace on num_threads threads */
+void run_parallel_sweep() {
+	num_workers = num_threads < num_simulators ? num_threads : num_simulators;
+	workers = calloc(num_workers, sizeof(struct Worker));
+
+	for( int i = 0; i < num_workers; i++ ) {
+		workers[i].id = i;
+		workers[i].head = (int)((long)num_simulators * i / num_workers);
+		workers[i].tail = (int)((long)num_simulators * (i + 1) / num_workers);
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	for( int i = 1; i < num_workers; i++ ) {
+		if( pthread_create(&workers[i].thread, NULL, sweep_worker, &workers[i]) != 0 ) {
+			fprintf(stderr, "Could not start sweep threads.\n");
+			exit(1);
 		}
-		position++;
+	}
+	sweep_worker(&workers[0]);	// the main thread works too
+	for( int i = 1; i < num_workers; i++ ) {
+		pthread_join(workers[i].thread, NULL);
 	}
 
-	return row_index;
+	for( int i = 0; i < num_workers; i++ ) {
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	free(workers);
+	free(trace_accesses);
+	trace_accesses = NULL;
+	trace_length = trace_capacity = 0;
 }
 
-//converst word array to an index
-int word_index_converter(char* word) {
-	int word_index = 0;
-	int base = 2;
-	int position = 0;
+/* Set-sharded simulation ******************************************************/
 
-	for( int i = word_bits; i > 0; i-- ) {
-		if( word[i] == '1' ) {
-			word_index += ( 1 * pow(base, position) );
-		}
-		position++;
+/*
+A single configuration on --threads N: sets never interact, so the trace is
+split by set index into N shards and each shard runs on its own thread against
+the same cache arrays, through a cachesim_share view. Each thread only ever
+touches its own sets, and keeps its own counters, which are added up at the
+end.
+
+Splitting is parallel too. The trace is cut into N chunks; thread c sorts
+chunk c into queues[c][shard], keeping trace order. Shard s then replays
+queues[0][s], queues[1][s], ... in turn, which is exactly the order its sets
+see in a serial run, so the results match it.
+*/
+
+struct ShardJob
+{
+	pthread_t thread;
+	int id;
+	cachesim_t* sim;	/* shares the cache arrays, has its own counters */
+};
+
+static struct Access** shard_queues = NULL;	/* [chunk * num_shards + shard] */
+static size_t* shard_lengths = NULL;
+static struct ShardJob* shard_jobs = NULL;
+static int num_shards = 0;
+
+/* which shard an access belongs to. Runs of 8 sets go to the same shard when
+there are enough sets, so neighbouring sets' masks don't bounce between cores */
+static inline int shard_of(const cachesim_t* sim, const struct Access* access) {
+	int row_index = cachesim_set_of(sim, access->type, access->address);
+
+	if( row_index < 0 ) {	// that cache is disabled
+		return 0;
+	}
+	if( cachesim_num_sets(sim, access->type) >= 8 * num_shards ) {
+		row_index >>= 3;
 	}
-	return word_index;
+	return row_index % num_shards;
 }
 
-/*adds new block to cache.cache[] at row_index, sets valid = 1, dirty = 0
-simulates pulling from memory*/
-void add_block(char* temp_word, char* temp_row, char* temp_tag, int row_index, char cache_type) {
-	switch(cache_type)
-	{
-		case 'I':
-		if( row_index < cache_size ) {
-			wrapper.cache[row_index].word_bits = temp_word;
-			wrapper.cache[row_index].row_bits = temp_row;
-			wrapper.cache[row_index].tag_bits = temp_tag;
-			wrapper.cache[row_index].valid = 0;
-			wrapper.cache[row_index].dirty = 0;
-		} else {	// cache is too small, add block to first index
-			add_block(temp_row, temp_row, temp_tag, 0, 'I');
-			compulsory_miss = compulsory_miss + wpb;
-		}
-		break;
-		case 'D':
-		if( row_index < d_cache_size ) {
-			d_wrapper.cache[row_index].word_bits = temp_word;
-			d_wrapper.cache[row_index].row_bits = temp_row;
-			d_wrapper.cache[row_index].tag_bits = temp_tag;
-			d_wrapper.cache[row_index].valid = 0;
-			d_wrapper.cache[row_index].dirty = 0;
-		} else {	// cache is too small, add block to first index
-			add_block(temp_word, temp_row, temp_tag, 0, 'D');
-			d_compulsory_miss = d_compulsory_miss + d_wpb;
-		}
-		break;
+static void* shard_partition_worker(void* arg) {
+	struct ShardJob* job = arg;
+	const cachesim_t* sim = simulators[0].sim;
+	size_t start = trace_length * job->id / num_shards;
+	size_t end = trace_length * (job->id + 1) / num_shards;
+	size_t* lengths = &shard_lengths[(size_t)job->id * num_shards];
+	struct Access** queues = &shard_queues[(size_t)job->id * num_shards];
+
+	for( size_t i = start; i < end; i++ ) {
+		lengths[shard_of(sim, &trace_accesses[i])]++;
 	}
+	for( int shard = 0; shard < num_shards; shard++ ) {
+		queues[shard] = malloc(sizeof(struct Access) * (lengths[shard] + 1));
+		lengths[shard] = 0;
+	}
+	for( size_t i = start; i < end; i++ ) {
+		int shard = shard_of(sim, &trace_accesses[i]);
+		queues[shard][lengths[shard]++] = trace_accesses[i];
+	}
+	return NULL;
 }
 
-/* replace word in a specified block using specified replacement type for cache */
-void replace_block(ReplacementType R, char* temp_word, char* temp_row, char* temp_tag, int row_index, char cache_type) {
-	int Replace_Block_index = 0;
-	if( cache_type == 'I' ) {
-		struct Block Replace_Block = wrapper.cache2D[row_index][0];
-		switch(R)
-		{
-			case Replacement_RANDOM:
-			if( row_index < cache_size ) {
-				wrapper.cache2D[row_index][rand()].word_bits = temp_word;
-				wrapper.cache2D[row_index][rand()].row_bits = temp_row;
-				wrapper.cache2D[row_index][rand()].tag_bits = temp_tag;
-				wrapper.cache2D[row_index][rand()].valid = 0;
-				wrapper.cache2D[row_index][rand()].dirty = 0;
-			}	else {
-				add_block(temp_row, temp_row, temp_tag, 0, 'I');
-				compulsory_miss++;
-			}
-			break;
-			case Replacement_LRU:
-			for( int i = 0; i < associativity-1; i++ ) {	// find the block to replace, lowest used_last means LRu
-				if( Replace_Block.used_last > wrapper.cache2D[row_index][i+1].used_last ) {
-					Replace_Block = wrapper.cache2D[row_index][i];
-					Replace_Block_index++;
-				}
-			}
-			if( row_index < cache_size ) {
-				wrapper.cache2D[row_index][Replace_Block_index].word_bits = temp_word;
-				wrapper.cache2D[row_index][Replace_Block_index].row_bits = temp_row;
-				wrapper.cache2D[row_index][Replace_Block_index].tag_bits = temp_tag;
-				wrapper.cache2D[row_index][Replace_Block_index].valid = 0;
-				wrapper.cache2D[row_index][Replace_Block_index].dirty = 0;
-			}	else {
-				add_block(temp_row, temp_row, temp_tag, 0, 'I');
-				compulsory_miss = compulsory_miss + wpb;
-			}
-			break;
-		}
-	} else {
-		struct Block Replace_Block = d_wrapper.cache2D[row_index][0];
-		switch(R)
-		{
-			case Replacement_RANDOM:
-			if( row_index < d_cache_size ) {
-				d_wrapper.cache2D[row_index][rand()].word_bits = temp_word;
-				d_wrapper.cache2D[row_index][rand()].row_bits = temp_row;
-				d_wrapper.cache2D[row_index][rand()].tag_bits = temp_tag;
-				d_wrapper.cache2D[row_index][rand()].valid = 0;
-				d_wrapper.cache2D[row_index][rand()].dirty = 0;
-			}	else {
-				add_block(temp_row, temp_row, temp_tag, 0, 'D');
-				d_compulsory_miss = d_compulsory_miss + d_wpb;
-			}
-			break;
-			case Replacement_LRU:
-			for( int i = 0; i < d_associativity-1; i++ ) {	// find the block to replace, lowest used_last means LRu
-				if( Replace_Block.used_last > d_wrapper.cache2D[row_index][i+1].used_last ) {
-					Replace_Block = d_wrapper.cache2D[row_index][i];
-					Replace_Block_index++;
-				}
-			}
-			if( row_index < d_cache_size ) {
-				d_wrapper.cache2D[row_index][Replace_Block_index].word_bits = temp_word;
-				d_wrapper.cache2D[row_index][Replace_Block_index].row_bits = temp_row;
-				d_wrapper.cache2D[row_index][Replace_Block_index].tag_bits = temp_tag;
-				d_wrapper.cache2D[row_index][Replace_Block_index].valid = 0;
-				d_wrapper.cache2D[row_index][Replace_Block_index].dirty = 0;
-			}	else {
-				add_block(temp_row, temp_row, temp_tag, 0, 'D');
-				d_compulsory_miss = d_compulsory_miss + d_wpb;
-			}
-			break;
-		}
+static void* shard_simulate_worker(void* arg) {
+	struct ShardJob* job = arg;
+
+	for( int chunk = 0; chunk < num_shards; chunk++ ) {
+		size_t queue = (size_t)chunk * num_shards + job->id;
+		cachesim_access_batch(job->sim, shard_queues[queue], shard_lengths[queue]);
+		free(shard_queues[queue]);
 	}
+	return NULL;
 }
 
-//write to d_cache based on alloation scheme
-void write_to_block(char* temp_word, char* temp_row, char* temp_tag, int row_index, int word_index, AllocateType A) {
-	int Replace_Block_index = 0;
-	struct Block Replace_Block = d_wrapper.cache2D[row_index][0];
-	// remember to set dirty bit to 0 if new block, and 1 if not new/in memory
-	switch(A)
-	{
-		case Allocate_ALLOCATE:
-		// implement write_allocate
-		if( associativity == 1 ) {
-			add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-		} else {
-			add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
+/* runs num_shards copies of worker, the main thread being the first */
+static void run_shard_threads(void* (*worker)(void*)) {
+	for( int i = 1; i < num_shards; i++ ) {
+		if( pthread_create(&shard_jobs[i].thread, NULL, worker, &shard_jobs[i]) != 0 ) {
+			fprintf(stderr, "Could not start simulation threads.\n");
+			exit(1);
 		}
-		break;
-		case Allocate_NO_ALLOCATE:
-		// implement write-No-allocate, only reads being cached
-		printf("Allocate_NO_ALLOCATE, handled in read access\n");
-		break;
+	}
+	worker(&shard_jobs[0]);
+	for( int i = 1; i < num_shards; i++ ) {
+		pthread_join(shard_jobs[i].thread, NULL);
 	}
 }
 
-//adds a block to 2D cache
-void add_block_2(char* temp_word, char* temp_row, char* temp_tag, int row_index, int word_index, char cache_type) {
-	switch(cache_type)
-	{
-		case 'I':
-		if( row_index < cache_size ) {
-			wrapper.cache2D[row_index][word_index].word_bits = temp_word;
-			wrapper.cache2D[row_index][word_index].row_bits = temp_row;
-			wrapper.cache2D[row_index][word_index].tag_bits = temp_tag;
-			wrapper.cache2D[row_index][word_index].valid = 0;
-			wrapper.cache2D[row_index][word_index].dirty = 0;
-		}	else {
-			compulsory_miss = compulsory_miss + wpb;
-			add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'I');
-		}
-		break;
-		case 'D':
-		if( row_index < d_cache_size ) {
-			d_wrapper.cache2D[row_index][word_index].word_bits = temp_word;
-			d_wrapper.cache2D[row_index][word_index].row_bits = temp_row;
-			d_wrapper.cache2D[row_index][word_index].tag_bits = temp_tag;
-			d_wrapper.cache2D[row_index][word_index].valid = 0;
-			d_wrapper.cache2D[row_index][word_index].dirty = 0;
-		}	else {
-			d_compulsory_miss = d_compulsory_miss + d_wpb;
-			add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
+/* whether a configuration's sets really are independent. Random replacement
+draws from one generator per cache, so its evictions depend on the order of
+every access to the cache, not just the set's; a prefetcher fills blocks in
+other sets than the one accessed, and a victim cache, write buffer, the
+most-missing blocks or a 3C shadow cache are shared by every set. Time
+sampling counts every access to place its windows */
+int can_shard(const struct Simulator* sim) {
+	return !(sim->icache_info.associativity > 1 && sim->icache_info.replacement == Replacement_RANDOM) &&
+		!(sim->dcache_info[0].associativity > 1 && sim->dcache_info[0].replacement == Replacement_RANDOM) &&
+		sim_options.top_blocks == 0 && !sim_options.classify_misses && sim_options.sample_window == 0 &&
+		sim_options.icache_prefetch.type == Prefetch_NONE && sim_options.dcache_prefetch.type == Prefetch_NONE &&
+		sim_options.victim_blocks == 0 && sim_options.write_buffer_entries == 0;
+}
+
+/* runs the one configuration over the loaded trace, sharded by set */
+void run_sharded_simulation() {
+	cachesim_t* sim = simulators[0].sim;
+
+	num_shards = num_threads;
+	shard_queues = calloc((size_t)num_shards * num_shards, sizeof(struct Access*));
+	shard_lengths = calloc((size_t)num_shards * num_shards, sizeof(size_t));
+	shard_jobs = calloc(num_shards, sizeof(struct ShardJob));
+
+	for( int i = 0; i < num_shards; i++ ) {
+		shard_jobs[i].id = i;
+		shard_jobs[i].sim = cachesim_share(sim);
+		if( shard_jobs[i].sim == NULL ) {
+			fprintf(stderr, "Out of memory starting simulation threads.\n");
+			exit(1);
 		}
-		break;
 	}
+
+	run_shard_threads(shard_partition_worker);
+	free(trace_accesses);
+	trace_accesses = NULL;
+	trace_length = trace_capacity = 0;
+
+	run_shard_threads(shard_simulate_worker);
+
+	for( int i = 0; i < num_shards; i++ ) {
+		cachesim_join(shard_jobs[i].sim);
+	}
+	free(shard_queues);
+	free(shard_lengths);
+	free(shard_jobs);
+}
+
+static void print_prefetch_statistics(const struct Stats* stats) {
+	printf("\tPrefetches issued: %llu\n", (unsigned long long)stats->prefetches);
+	printf("\tUseful prefetches: %llu\n", (unsigned long long)stats->useful_prefetches);
+	printf("\tLate prefetches: %llu\n", (unsigned long long)stats->late_prefetches);
+	printf("\tPolluting prefetches: %llu\n", (unsigned long long)stats->polluting_prefetches);
+}
+
+/* a sampled run's estimate of a cache's miss rate */
+static void print_estimate(const struct Simulator* sim, AccessType type) {
+	struct MissEstimate estimate;
+
+	if( !cachesim_estimate(sim->sim, type, &estimate) ) {
+		return;
+	}
+	printf("\tEstimated miss rate: %.4f", estimate.miss_rate);
+	if( estimate.error >= 0 ) {
+		printf(" +- %.4f (95%% confidence)", estimate.error);
+	}
+	printf(" from %llu sampled %s\n", (unsigned long long)estimate.samples,
+		sim_options.sample_window != 0 ? "windows" : "sets");
 }
 
-void handle_access(AccessType type, memaddr_t address)
+void print_statistics(const struct Simulator* sim)
 {
-	int row_index = 0;
-	int word_index = 0;
-	char row[row_bits+1];
-	char word[word_bits+1];
-	char tag[tag_bits+1];
+	/* Finally, after all the simulation happens, you have to show what the
+	results look like. Do that here.*/
+	struct Stats icache, dcache;
+	struct Metrics metrics;
+
+	cachesim_get_stats(sim->sim, &icache, &dcache);
+
+	if( sim->name != NULL ) {
+		printf("Configuration: %s\n", sim->name);
+	}
 
-	//convert address from hex to binary and store it in binary_address
-	hex_binary_converter(address, binary, binary_address);
+	/************i-cache stats**************************/
+	printf("Instruction cache:\n");
+	cachesim_metrics(&icache, icache.reads, &metrics);
+	printf("\tNumber of reads from the cache: %llu\n", (unsigned long long)icache.reads);
+	printf("\tNumber of conflict misses: %llu\n", (unsigned long long)icache.conflict_miss);
+	printf("\tNumber of words loaded from memory: %llu\n", (unsigned long long)icache.mem_reads);
+	printf("\tcompulsory_misses: %llu\n", (unsigned long long)icache.compulsory_miss);
+	if( sim_options.classify_misses ) {
+		printf("\tcapacity_misses: %llu\n", (unsigned long long)icache.capacity_miss);
+	}
+	printf("\tRead miss rate (with compulsory): %.2f\n", metrics.miss_rate);
+	printf("\tRead miss rate (without compulsory): %.2f\n", metrics.miss_rate_without_compulsory);
+	print_estimate(sim, Access_I_FETCH);
+	if( sim_options.icache_prefetch.type != Prefetch_NONE ) {
+		print_prefetch_statistics(&icache);
+	}
 
-	// Fill tag array
-	address_decompress('t', tag, binary_address);
+	/*******************d-cache stats****************************/
+	printf("Data cache\n");
+	cachesim_metrics(&dcache, icache.reads, &metrics);
+	printf("\tNumber of reads from the cache: %llu\n", (unsigned long long)dcache.reads);
+	printf("\tMemory reads: %llu\n", (unsigned long long)dcache.mem_reads);
+	printf("\tNumber of writes to cache: %llu\n", (unsigned long long)dcache.writes);
+	printf("\tNumber of words written to memory: %llu\n", (unsigned long long)dcache.words_written_to_mem);
+	printf("\tcompulsory misses: %llu\n", (unsigned long long)dcache.compulsory_miss);
+	if( sim_options.classify_misses ) {
+		printf("\tCapacity misses: %llu\n", (unsigned long long)dcache.capacity_miss);
+	}
+	printf("\tConflict misses: %llu\n", (unsigned long long)dcache.conflict_miss);
+	printf("\tMiss rate (with compulsory): %.2f\n", metrics.miss_rate);
+	printf("\tMiss rate (without compulsory): %.2f\n", metrics.miss_rate_without_compulsory);
+	print_estimate(sim, Access_D_READ);
+	if( sim_options.dcache_prefetch.type != Prefetch_NONE ) {
+		print_prefetch_statistics(&dcache);
+	}
+	if( sim_options.victim_blocks != 0 ) {
+		printf("\tVictim cache hits: %llu\n", (unsigned long long)dcache.victim_hits);
+	}
+	if( sim_options.write_buffer_entries != 0 ) {
+		printf("\tWrite buffer merges: %llu\n", (unsigned long long)dcache.write_buffer_merges);
+	}
 
-	//fill word array
-	address_decompress('w', word, binary_address);
+	if( report_footprint ) {
+		const char* backing;
+		size_t bytes = cachesim_footprint(sim->sim, &backing);
+		printf("Cache metadata: %zu bytes (%s)\n", bytes, backing);
+	}
+}
+/* Instrumentation output ****************************************************/
 
-	//fill row array
-	address_decompress('r', row, binary_address);
+static int is_json_name(const char* filename) {
+	size_t length = strlen(filename);
+	return length >= 5 && strcmp(filename + length - 5, ".json") == 0;
+}
 
-	//convert row[] to row_index
-	row_index = row_index_converter(row);
+/* a configuration's name as a CSV field or JSON value */
+static void put_csv_name(FILE* out, const char* name) {
+	fputc('"', out);
+	for( const char* p = name ? name : ""; *p != '\0'; p++ ) {
+		if( *p == '"' ) {
+			fputc('"', out);
+		}
+		fputc(*p, out);
+	}
+	fputc('"', out);
+}
 
-	//convert word[] to word_index
-	word_index = word_index_converter(word);
+static void put_json_name(FILE* out, const char* name) {
+	if( name == NULL ) {
+		fputs("null", out);
+		return;
+	}
+	fputc('"', out);
+	for( const char* p = name; *p != '\0'; p++ ) {
+		if( *p == '"' || *p == '\\' ) {
+			fprintf(out, "\\%c", *p);
+		} else if( (unsigned char)*p < 0x20 ) {
+			fprintf(out, "\\u%04x", *p);
+		} else {
+			fputc(*p, out);
+		}
+	}
+	fputc('"', out);
+}
 
-	char temp_word[sizeof(word)];
-	char temp_row[sizeof(row)];
-	char temp_tag[sizeof(tag)];
+static const AccessType instrumented_caches[2] = { Access_I_FETCH, Access_D_READ };
 
-	strcpy(temp_word, word);
-	strcpy(temp_row, row);
-	strcpy(temp_tag, tag);
+/* the heatmap's columns, per set */
+static const char* const set_columns[4] = { "accesses", "hits", "misses", "evictions" };
 
-	/* This is where all the fun stuff happens! This function is called to
-	simulate a memory access. You figure out what type it is, and do all your
-	fun simulation stuff from here. */
-	switch(type)
+static unsigned long long set_count(const struct SetStats* set, int column) {
+	switch(column)
 	{
-		case Access_I_FETCH:
-		if( associativity == 1 ) {
-			if( wrapper.cache[row_index].tag_bits != '\0' ) {
-				if( !strcmp(wrapper.cache[row_index].tag_bits, tag) ) {
-					read_cache++;
-				} else {
-					mem_reads++;
-					conflict_miss++;
-				}
-			} else {
-				add_block(temp_word, temp_row, temp_tag, row_index, 'I');
-				compulsory_miss++;
-				mem_reads++;
-			}
-		} else {	// associativity > 1, not direct-mapped
-			if( wrapper.cache2D[row_index][word_index].tag_bits != '\0' ) {
-				if( !strcmp(wrapper.cache2D[row_index][word_index].tag_bits, tag) ) {
-					if( !strcmp(wrapper.cache2D[row_index][word_index].word_bits, word) ) {
-						wrapper.cache2D[row_index][word_index].used_last++;
-						read_cache++;
-					} else {
-						replace_block(icache_info.replacement, temp_word, temp_row, temp_tag, row_index, 'I');
-						mem_reads = mem_reads + wpb;
-						conflict_miss++;
-					}
-				}
-			} else {
-				add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'I');
-				compulsory_miss = compulsory_miss + wpb;
-				mem_reads = mem_reads + wpb;
+		case 0: return set->accesses;
+		case 1: return set->accesses - set->misses;
+		case 2: return set->misses;
+		default: return set->evictions;
+	}
+}
+
+void write_heatmap(FILE* out, int json) {
+	int first = 1;
+
+	if( json ) {
+		fputs("[\n", out);
+	} else {
+		fputs("configuration,cache,set,accesses,hits,misses,evictions\n", out);
+	}
+	for( int i = 0; i < num_simulators; i++ ) {
+		for( int c = 0; c < 2; c++ ) {
+			const struct SetStats* sets;
+			int num_sets = cachesim_set_stats(simulators[i].sim, instrumented_caches[c], &sets);
+			const char* cache = c ? "D" : "I";
+
+			if( num_sets == 0 ) {
+				continue;
 			}
-		}
-		break;
-		/************************************************************************************/
-		case Access_D_READ:
-		switch(w_scheme) {
-			/**********************************************************/
-			case Write_WRITE_BACK:
-			if( d_associativity == 1 ) {	// direct-mapped
-				if( d_wrapper.cache[row_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache[row_index].tag_bits, tag) ) {
-						d_read_cache++;
-					} else if( d_wrapper.cache[row_index].dirty == 1 ) {
-						d_mem_reads++;
-						d_conflict_miss++;
-						words_written_to_mem++;
-						add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-					} else {
-						d_mem_reads++;
-						d_conflict_miss++;
-						add_block(temp_word, temp_row, temp_tag, row_index, 'D');
+			if( !json ) {
+				for( int set = 0; set < num_sets; set++ ) {
+					put_csv_name(out, simulators[i].name);
+					fprintf(out, ",%s,%d", cache, set);
+					for( int column = 0; column < 4; column++ ) {
+						fprintf(out, ",%llu", set_count(&sets[set], column));
 					}
-				} else {
-					add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-					d_compulsory_miss++;
-					d_mem_reads++;
-				}
-			} else {	// associativity > 1, not direct-mapped
-				if( d_wrapper.cache2D[row_index][word_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache2D[row_index][word_index].tag_bits, tag) ) {
-						if( !strcmp(d_wrapper.cache2D[row_index][word_index].word_bits, word) ) {
-							d_wrapper.cache2D[row_index][word_index].used_last++;
-							d_read_cache++;
-						} else if( d_wrapper.cache2D[row_index][word_index].dirty == 1 ) {	//checking if word is dirty
-							replace_block(dcache_info[0].replacement, temp_word, temp_row, temp_tag, row_index, 'D');
-							d_mem_reads = d_mem_reads + d_wpb;
-							d_conflict_miss = d_conflict_miss + d_wpb;
-							words_written_to_mem = words_written_to_mem + d_wpb;
-						} else {
-							replace_block(dcache_info[0].replacement, temp_word, temp_row, temp_tag, row_index, 'D');
-							d_mem_reads = d_mem_reads + d_wpb;
-							d_conflict_miss= d_conflict_miss + d_wpb;
-						}
-					}
-				} else {
-					add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
-					d_compulsory_miss = d_compulsory_miss + d_wpb;
-					d_mem_reads = d_mem_reads + d_wpb;
+					fputc('\n', out);
 				}
+				continue;
 			}
-			break;
-			/************************************************************************************/
-			case Write_WRITE_THROUGH:
-			if( d_associativity == 1) {
-				if( d_wrapper.cache[row_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache[row_index].tag_bits, tag) ) {	//	checking tag
-						d_read_cache++;
-					} else {
-						d_conflict_miss++;
-						write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-						writes_to_cache++;
-						d_read_cache++;
-						words_written_to_mem++;
-					}
-				} else {
-					d_mem_reads++;
-					d_read_cache++;
-					d_compulsory_miss++;
-					add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-				}
-			} else {	// not direct-mapped associativity > 1
-				if( d_wrapper.cache2D[row_index][word_index].tag_bits != '\0' ) {	//seeing if block is null/empty
-					if( !strcmp(d_wrapper.cache2D[row_index][word_index].tag_bits, tag) ) {	//checking tag
-						d_read_cache++;
-					} else {
-						d_conflict_miss = d_conflict_miss + d_wpb;
-						d_mem_reads = d_mem_reads + d_wpb;
-						write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-						writes_to_cache = writes_to_cache + d_wpb;
-						d_read_cache++;
-						words_written_to_mem = words_written_to_mem + d_wpb;
-					}
-				} else {
-					d_read_cache++;
-					d_compulsory_miss = d_compulsory_miss + d_wpb;
-					d_mem_reads = d_mem_reads + d_wpb;
-					add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
+			fputs(first ? "{\"configuration\": " : ",\n{\"configuration\": ", out);
+			first = 0;
+			put_json_name(out, simulators[i].name);
+			fprintf(out, ", \"cache\": \"%s\"", cache);
+			for( int column = 0; column < 4; column++ ) {	// one array per column
+				fprintf(out, ",\n\"%s\": [", set_columns[column]);
+				for( int set = 0; set < num_sets; set++ ) {
+					fprintf(out, set ? ",%llu" : "%llu", set_count(&sets[set], column));
 				}
+				fputc(']', out);
 			}
-			break;
+			fputc('}', out);
 		}
-		break;
-		/********************************************************************************************/
-		case Access_D_WRITE:
-		switch(w_scheme) {
-			case Write_WRITE_BACK:
-			if( d_associativity == 1) {	//direct-mapped
-				if( d_wrapper.cache[row_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache[row_index].tag_bits, tag) ) {	//check tag
-						d_read_cache++;
-					} else {
-						d_read_cache++;
-						if( d_wrapper.cache[row_index].dirty == 1 ) {	//check if block is dirty
-							words_written_to_mem++;
-							write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-							writes_to_cache++;
-						} else {	//write to mem and fill in new block
-							words_written_to_mem++;
-							d_mem_reads++;
-							write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-							writes_to_cache++;
-						}
-					}
-				} else {
-					d_compulsory_miss++;
-					writes_to_cache++;
-					d_mem_reads++;
-					add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-				}
-			} else {	//not direct mapped
-				if( d_wrapper.cache2D[row_index][word_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache2D[row_index][word_index].tag_bits, tag) ) {
-						d_read_cache++;
-					} else {	// bad data
-						d_read_cache++;
-						d_conflict_miss = d_conflict_miss + d_wpb;
-						if( d_wrapper.cache2D[row_index][word_index].dirty == 1 ) {	//check if block is dirty
-							words_written_to_mem = words_written_to_mem + d_wpb;
-							write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-							writes_to_cache = writes_to_cache + d_wpb;
-						} else {
-							words_written_to_mem = words_written_to_mem + d_wpb;
-							write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-							writes_to_cache = writes_to_cache + d_wpb;
-						}
-					}
-				} else { // nothing is in the cache
-					d_compulsory_miss = d_compulsory_miss + d_wpb;
-					writes_to_cache = writes_to_cache + d_wpb;
-					add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
-				}
+	}
+	if( json ) {
+		fputs("\n]\n", out);
+	}
+}
+
+void write_hot_blocks(FILE* out, int json) {
+	int top = sim_options.top_blocks;
+	struct HotBlock* blocks = malloc(top * sizeof(struct HotBlock));
+	int first = 1;
+
+	if( json ) {
+		fputs("[\n", out);
+	} else {
+		fputs("configuration,cache,rank,address,misses,error\n", out);
+	}
+	for( int i = 0; i < num_simulators; i++ ) {
+		for( int c = 0; c < 2; c++ ) {
+			int n = cachesim_hot_blocks(simulators[i].sim, instrumented_caches[c], blocks, top);
+			const char* cache = c ? "D" : "I";
+
+			if( n == 0 ) {
+				continue;
 			}
-			break;
-			/*******************************************************************************************8*/
-			case Write_WRITE_THROUGH:
-			if( d_associativity == 1) {	 //dirct mapped
-				if( d_wrapper.cache[row_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache[row_index].tag_bits, tag) ) {
-						d_read_cache++;
-					} else {
-						write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-						words_written_to_mem++;
-						d_conflict_miss++;
-					}
+			if( json ) {
+				fputs(first ? "{\"configuration\": " : ",\n{\"configuration\": ", out);
+				first = 0;
+				put_json_name(out, simulators[i].name);
+				fprintf(out, ", \"cache\": \"%s\", \"blocks\": [", cache);
+			}
+			for( int rank = 0; rank < n; rank++ ) {
+				if( json ) {
+					fprintf(out, "%s\n{\"address\": \"0x%lx\", \"misses\": %llu, \"error\": %llu}",
+						rank ? "," : "", blocks[rank].address, (unsigned long long)blocks[rank].misses,
+						(unsigned long long)blocks[rank].error);
 				} else {
-					d_compulsory_miss++;
-					writes_to_cache++;
-					add_block(temp_word, temp_row, temp_tag, row_index, 'D');
-				}
-			} else {	// not direct mapped
-				if( d_wrapper.cache2D[row_index][word_index].tag_bits != '\0' ) {
-					if( !strcmp(d_wrapper.cache2D[row_index][word_index].tag_bits, tag) ) {
-						d_read_cache++;
-					} else {	// bad data
-						write_to_block(temp_word, temp_row, temp_tag, row_index, word_index, a_type);
-						words_written_to_mem = words_written_to_mem + d_wpb;
-						d_conflict_miss = d_conflict_miss + d_wpb;
-					}
-				} else { // nothing is in the cache
-					d_compulsory_miss = d_compulsory_miss + d_wpb;
-					writes_to_cache = writes_to_cache + d_wpb;
-					add_block_2(temp_word, temp_row, temp_tag, row_index, word_index, 'D');
+					put_csv_name(out, simulators[i].name);
+					fprintf(out, ",%s,%d,0x%lx,%llu,%llu\n", cache, rank + 1, blocks[rank].address,
+						(unsigned long long)blocks[rank].misses, (unsigned long long)blocks[rank].error);
 				}
 			}
-			break;
+			if( json ) {
+				fputs("]}", out);
+			}
 		}
-		break;
 	}
+	if( json ) {
+		fputs("\n]\n", out);
+	}
+	free(blocks);
 }
 
-void print_statistics()
-{
-	/* Finally, after all the simulation happens, you have to show what the
-	results look like. Do that here.*/
-	/************i-cache stats**************************/
-	printf("Instruction cache:\n");
-	printf("\tNumber of reads from the cache: %d\n", read_cache);
-	printf("\tNumber of conflict misses: %d\n", conflict_miss);
-	printf("\tNumber of words loaded from memory: %d\n", mem_reads);
-	printf("\tcompulsory_misses: %d\n", compulsory_miss);
-	miss_rate = (float)(conflict_miss + compulsory_miss)/(float)read_cache;
-	printf("\tRead miss rate (with compulsory): %.2f\n", miss_rate);
-	miss_rate = (float)(conflict_miss)/(float)read_cache;
-	printf("\tRead miss rate (without compulsory): %.2f\n", miss_rate);
+/* Checkpoints ***************************************************************/
 
-	/*******************d-cache stats****************************/
-	printf("Data cache\n");
-	printf("\tNumber of reads from the cache: %d\n", d_read_cache);
-	printf("\tMemory reads: %d\n", d_mem_reads);
-	printf("\tNumber of writes to cache: %d\n", writes_to_cache);
-	printf("\tNumber of words written to memory: %d\n", words_written_to_mem);
-	printf("\tcompulsory misses: %d\n", d_compulsory_miss);
-	printf("\tConflict misses: %d\n", d_conflict_miss);
-	miss_rate = (float)(d_conflict_miss + d_compulsory_miss)/(float)d_read_cache;
-	printf("\tRead miss rate (with compulsory): %.2f\n", miss_rate);
-	miss_rate = (float)(d_conflict_miss)/(float)d_read_cache;
-	printf("\tRead miss rate (without compulsory): %.2f\n", miss_rate);
+static uint64_t trace_position = 0;	/* accesses read from the trace so far */
+static uint64_t trace_hash = 0;	/* of all of them */
+static uint64_t resume_position = 0;	/* where the restored checkpoint left off */
+static uint64_t resume_hash = 0;	/* and the hash it had there */
+
+/* --restore: puts the simulator back in the state the checkpoint saved */
+void restore_checkpoint() {
+	struct TracePosition position;
+	const char* problem = cachesim_restore(simulators[0].sim, restore_file, &position);
+
+	resume_position = position.accesses;
+	resume_hash = position.hash;
+	if( problem != NULL ) {
+		fprintf(stderr, "%s\n", problem);
+		exit(1);
+	}
 }
-/*******************************************************************************
-*
-*
-*
-* DO NOT MODIFY ANYTHING BELOW THIS LINE!
-*
-*
-*
-*******************************************************************************/
 
-void dump_cache_info()
-{
-	int i;
-	CacheInfo* info;
+/* --checkpoint */
+void save_checkpoint() {
+	struct TracePosition position = { trace_position, trace_hash };
+	const char* problem = cachesim_save(simulators[0].sim, checkpoint_file, &position);
 
-	printf("Instruction cache:\n");
-	printf("\t%d blocks\n", icache_info.num_blocks);
+	if( problem != NULL ) {
+		fprintf(stderr, "%s\n", problem);
+		exit(1);
+	}
+}
+
+/* Intervals *****************************************************************/
+
+/*
+For --intervals and --warmup, accesses go through interval_access on their way
+to the batch. It counts them, and when the count (of accesses, or of
+instruction fetches for Ni intervals) reaches next_boundary it runs the batch
+up to there and ends the warm-up or writes out the interval. interval_base has
+each configuration's counters when the current interval began, I-cache then
+D-cache.
+*/
+static uint64_t interval_accesses = 0;
+static uint64_t interval_fetches = 0;
+static uint64_t* interval_clock = &interval_accesses;	/* what next_boundary counts */
+static uint64_t next_boundary = UINT64_MAX;
+static uint64_t interval_number = 0;
+static uint64_t interval_start = 0;	/* interval_accesses when it began */
+static int warming_up = 0;
+static struct Stats* interval_base = NULL;
+
+/* every counter in struct Stats by name, for --intervals and --stats=json */
+static const struct
+{
+	const char* name;
+	size_t offset;
+} stat_columns[] = {
+	{ "reads", offsetof(struct Stats, reads) },
+	{ "writes", offsetof(struct Stats, writes) },
+	{ "mem_reads", offsetof(struct Stats, mem_reads) },
+	{ "words_written_to_mem", offsetof(struct Stats, words_written_to_mem) },
+	{ "compulsory_miss", offsetof(struct Stats, compulsory_miss) },
+	{ "conflict_miss", offsetof(struct Stats, conflict_miss) },
+	{ "capacity_miss", offsetof(struct Stats, capacity_miss) },
+	{ "write_misses", offsetof(struct Stats, write_misses) },
+	{ "prefetches", offsetof(struct Stats, prefetches) },
+	{ "useful_prefetches", offsetof(struct Stats, useful_prefetches) },
+	{ "late_prefetches", offsetof(struct Stats, late_prefetches) },
+	{ "polluting_prefetches", offsetof(struct Stats, polluting_prefetches) },
+	{ "victim_hits", offsetof(struct Stats, victim_hits) },
+	{ "write_buffer_merges", offsetof(struct Stats, write_buffer_merges) },
+};
+
+#define STAT_COLUMNS (sizeof(stat_columns) / sizeof(stat_columns[0]))
+
+static uint64_t* stat_column(struct Stats* stats, size_t column) {
+	return (uint64_t*)((char*)stats + stat_columns[column].offset);
+}
+
+static unsigned long long stat_value(const struct Stats* stats, size_t column) {
+	return *(const uint64_t*)((const char*)stats + stat_columns[column].offset);
+}
+
+/* one row of the --intervals file: a cache's counters went up by delta while
+the configuration ran instructions instructions */
+static void write_interval_row(const struct Simulator* sim, const char* cache, const struct Stats* delta,
+	uint64_t instructions) {
+	FILE* out = interval_file;
+	struct Metrics metrics;
+
+	cachesim_metrics(delta, instructions, &metrics);
+
+	if( interval_json ) {
+		fputs("{\"configuration\": ", out);
+		put_json_name(out, sim->name);
+		fprintf(out, ", \"interval\": %llu, \"first_access\": %llu, \"accesses\": %llu, \"cache\": \"%s\"",
+			(unsigned long long)interval_number, (unsigned long long)interval_start,
+			(unsigned long long)(interval_accesses - interval_start), cache);
+		for( size_t column = 0; column < STAT_COLUMNS; column++ ) {
+			fprintf(out, ", \"%s\": %llu", stat_columns[column].name, stat_value(delta, column));
+		}
+		fprintf(out, ", \"miss_rate\": %.6f, \"mpki\": %.4f}\n", metrics.miss_rate, metrics.mpki);
+		return;
+	}
+	put_csv_name(out, sim->name);
+	fprintf(out, ",%llu,%llu,%llu,%s", (unsigned long long)interval_number, (unsigned long long)interval_start,
+		(unsigned long long)(interval_accesses - interval_start), cache);
+	for( size_t column = 0; column < STAT_COLUMNS; column++ ) {
+		fprintf(out, ",%llu", stat_value(delta, column));
+	}
+	fprintf(out, ",%.6f,%.4f\n", metrics.miss_rate, metrics.mpki);
+}
+
+/* writes out the interval that just ended and starts the next */
+static void write_interval() {
+	for( int i = 0; i < num_simulators; i++ ) {
+		struct Stats now[2], delta[2];
+
+		cachesim_get_stats(simulators[i].sim, &now[0], &now[1]);
+		for( int c = 0; c < 2; c++ ) {
+			for( size_t column = 0; column < STAT_COLUMNS; column++ ) {
+				*stat_column(&delta[c], column) = *stat_column(&now[c], column) -
+					*stat_column(&interval_base[2 * i + c], column);
+			}
+			interval_base[2 * i + c] = now[c];
+		}
+		write_interval_row(&simulators[i], "I", &delta[0], delta[0].reads);
+		write_interval_row(&simulators[i], "D", &delta[1], delta[0].reads);
+	}
+	fflush(interval_file);
+	interval_number++;
+	interval_start = interval_accesses;
+}
+
+/* where interval_access stops next, once the warm-up is over */
+static void next_interval() {
+	interval_clock = interval_instructions ? &interval_fetches : &interval_accesses;
+	next_boundary = interval_file != NULL ? *interval_clock + interval_length : UINT64_MAX;
+}
+
+static void interval_boundary() {
+	simulate_batch();
+	if( warming_up ) {
+		for( int i = 0; i < num_simulators; i++ ) {
+			cachesim_reset_stats(simulators[i].sim);
+		}
+		memset(interval_base, 0, sizeof(struct Stats) * 2 * num_simulators);
+		warming_up = 0;
+		interval_start = interval_accesses;
+	} else {
+		write_interval();
+	}
+	next_interval();
+}
+
+/* access_handler for --intervals and --warmup */
+static void interval_access(AccessType type, memaddr_t address) {
+	interval_accesses++;
+	interval_fetches += (type == Access_I_FETCH);
+	batch_access(type, address);
+	if( *interval_clock == next_boundary ) {
+		interval_boundary();
+	}
+}
+
+/* counts intervals from the counters the caches start with, and the trace
+position they start at (a restored checkpoint's, say), and writes the
+--intervals file's header */
+void setup_intervals() {
+	interval_accesses = resume_position;
+	interval_start = resume_position;
+	interval_base = malloc(sizeof(struct Stats) * 2 * num_simulators);
+	for( int i = 0; i < num_simulators; i++ ) {
+		cachesim_get_stats(simulators[i].sim, &interval_base[2 * i], &interval_base[2 * i + 1]);
+	}
+	if( warmup_accesses != 0 ) {
+		warming_up = 1;
+		next_boundary = interval_accesses + warmup_accesses;
+	} else {
+		next_interval();
+	}
+	if( interval_file != NULL && !interval_json ) {
+		fputs("configuration,interval,first_access,accesses,cache", interval_file);
+		for( size_t column = 0; column < STAT_COLUMNS; column++ ) {
+			fprintf(interval_file, ",%s", stat_columns[column].name);
+		}
+		fputs(",miss_rate,mpki\n", interval_file);
+	}
+}
+
+/* writes out the last interval, if it got any accesses, once the trace is done */
+void finish_intervals() {
+	if( interval_file != NULL && !warming_up && interval_accesses != interval_start ) {
+		write_interval();
+	}
+	free(interval_base);
+}
+
+/* Statistics as JSON ********************************************************/
+
+/* one cache's object in --stats=json: its parameters, counters and metrics */
+static void put_json_cache(const CacheInfo* info, int data, const struct Stats* stats, uint64_t instructions,
+	int have_estimate, const struct MissEstimate* estimate) {
+	struct Metrics metrics;
+
+	cachesim_metrics(stats, instructions, &metrics);
+	printf("{\"num_blocks\": %d, \"words_per_block\": %d, \"associativity\": %d, \"replacement\": \"%s\"",
+		info->num_blocks, info->words_per_block, info->associativity,
+		cachesim_replacement_name(info->replacement));
+	if( data ) {
+		printf(", \"write_scheme\": \"%s\", \"allocate_scheme\": \"%s\"",
+			info->write_scheme == Write_WRITE_BACK ? "write-back" : "write-through",
+			info->allocate_scheme == Allocate_ALLOCATE ? "write-allocate" : "write-no-allocate");
+	}
+	for( size_t column = 0; column < STAT_COLUMNS; column++ ) {
+		printf(", \"%s\": %llu", stat_columns[column].name, stat_value(stats, column));
+	}
+	printf(", \"accesses\": %llu, \"misses\": %llu, \"read_misses\": %llu",
+		(unsigned long long)metrics.accesses, (unsigned long long)metrics.misses,
+		(unsigned long long)metrics.read_misses);
+	printf(", \"miss_rate\": %.6f, \"miss_rate_without_compulsory\": %.6f", metrics.miss_rate,
+		metrics.miss_rate_without_compulsory);
+	printf(", \"read_miss_rate\": %.6f, \"write_miss_rate\": %.6f", metrics.read_miss_rate,
+		metrics.write_miss_rate);
+	printf(", \"mpki\": %.4f, \"traffic_bytes\": %llu", metrics.mpki, (unsigned long long)metrics.traffic_bytes);
+	if( have_estimate ) {
+		printf(", \"estimate\": {\"miss_rate\": %.6f, \"error\": ", estimate->miss_rate);
+		if( estimate->error >= 0 ) {
+			printf("%.6f", estimate->error);
+		} else {
+			printf("null");
+		}
+		printf(", \"samples\": %llu}", (unsigned long long)estimate->samples);
+	}
+	printf("}");
+}
+
+/* a configuration's object in --stats=json, after a comma unless it's first */
+void print_statistics_json(const struct Simulator* sim, int first) {
+	struct Stats icache, dcache;
+	struct MissEstimate estimates[2];
+	int have_estimate[2];
+
+	cachesim_get_stats(sim->sim, &icache, &dcache);
+	have_estimate[0] = cachesim_estimate(sim->sim, Access_I_FETCH, &estimates[0]);
+	have_estimate[1] = cachesim_estimate(sim->sim, Access_D_READ, &estimates[1]);
+
+	printf(first ? "{\"configuration\": " : ",\n{\"configuration\": ");
+	put_json_name(stdout, sim->name);
+	printf(", \"instructions\": %llu,\n\"icache\": ", (unsigned long long)icache.reads);
+	put_json_cache(&sim->icache_info, 0, &icache, icache.reads, have_estimate[0], &estimates[0]);
+	printf(",\n\"dcache\": ");
+	put_json_cache(&sim->dcache_info[0], 1, &dcache, icache.reads, have_estimate[1], &estimates[1]);
+	printf(",\n\"metadata_bytes\": %zu}", cachesim_footprint(sim->sim, NULL));
+}
+
+/* Trace ingestion ***********************************************************/
+
+/* how much trace went through the reader, for --trace-stats */
+struct TraceStats
+{
+	unsigned long lines;
+	unsigned long bytes;
+	double seconds;
+};
+
+struct TraceStats trace_stats;
+static int report_trace_stats = 0;
+static int parse_only = 0;
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* value of each hex digit, 0xff for anything that is not one */
+static unsigned char hex_value[256];
+
+static void hex_table_setup() {
+	memset(hex_value, 0xff, sizeof(hex_value));
+	for( int i = 0; i < 10; i++ ) {
+		hex_value['0' + i] = i;
+	}
+	for( int i = 0; i < 6; i++ ) {
+		hex_value['a' + i] = 10 + i;
+		hex_value['A' + i] = 10 + i;
+	}
+}
+
+/* where parsed accesses go: the simulators (through the access batch), or the
+binary trace writer when converting, or nowhere for --parse-only */
+static void (*access_handler)(AccessType, memaddr_t) = batch_access;
+
+static void ignore_access(AccessType type, memaddr_t address) {
+	(void)type;
+	(void)address;
+}
+
+/* sends one parsed trace line on to access_handler */
+static void dispatch_access(memaddr_t address, char type) {
+	switch(type)
+	{
+		case 'R': access_handler(Access_D_READ, address);  break;
+		case 'W': access_handler(Access_D_WRITE, address); break;
+		case 'I': access_handler(Access_I_FETCH, address); break;
+		default:
+		fprintf(stderr, "Malformed trace file: invalid access type '%c'.\n",
+		type);
+		exit(1);
+		break;
+	}
+}
+
+/*
+Trace positions. With --checkpoint, --restore or --stop-after, accesses go
+through positioned_access on their way to access_handler's usual target, which
+counts them from the start of the trace and hashes them, drops the ones a
+restored checkpoint has already simulated (once their hash matches the
+checkpoint's), and stops the trace once --stop-after more have gone through.
+The readers check trace_stopped and give up early.
+*/
+static int trace_stopped = 0;
+static int resumed = 0;	/* the trace got to the restored position */
+static void (*positioned_handler)(AccessType, memaddr_t);
+
+/* the trace got to the restored checkpoint's position: it had better be the
+trace the checkpoint was taken from */
+static void check_resume() {
+	if( trace_hash != resume_hash ) {
+		fprintf(stderr, "The trace isn't the one the checkpoint was taken from.\n");
+		exit(1);
+	}
+	resumed = 1;
+}
+
+/* counts an access into trace_position and trace_hash (FNV-1a, an access at a
+time rather than a byte) */
+static inline void count_position(AccessType type, memaddr_t address) {
+	trace_hash = (trace_hash ^ ((uint64_t)address << 2 ^ type)) * 0x100000001b3ull;
+	trace_position++;
+}
+
+static void positioned_access(AccessType type, memaddr_t address) {
+	if( trace_position < resume_position ) {
+		count_position(type, address);
+		return;
+	}
+	if( !resumed ) {
+		check_resume();
+	}
+	if( stop_after != 0 && trace_position - resume_position == stop_after ) {
+		trace_stopped = 1;
+		return;
+	}
+	count_position(type, address);
+	positioned_handler(type, address);
+}
+
+/* once the trace is read: did it get as far as the restored position? */
+static void finish_positions() {
+	if( trace_position < resume_position ) {
+		fprintf(stderr, "The trace ends before the checkpoint's position.\n");
+		exit(1);
+	}
+	if( !resumed ) {
+		check_resume();
+	}
+}
+
+/*
+Scans every "0x<hex> <type>" line in [p, end) and feeds it to the simulator.
+Works straight off the bytes, no copies and no libc parsing. Lines that do not
+look like an access are skipped, same as the sscanf path does.
+*/
+static void scan_trace_buffer(const char* p, const char* end) {
+	while( p < end && !trace_stopped ) {
+		memaddr_t address = 0;
+		const char* digits;
+		unsigned char v;
+
+		while( p < end && (*p == ' ' || *p == '\t') ) {
+			p++;
+		}
+		if( end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') ) {
+			p += 2;
+			digits = p;
+			while( p < end && (v = hex_value[(unsigned char)*p]) != 0xff ) {
+				address = (address << 4) | v;
+				p++;
+			}
+			while( p < end && (*p == ' ' || *p == '\t') ) {
+				p++;
+			}
+			if( p > digits && p < end && *p != '\n' && *p != '\r' ) {
+				dispatch_access(address, *p);
+			}
+		}
+
+		p = memchr(p, '\n', end - p);	// on to the next line
+		if( p == NULL ) {
+			p = end;
+		} else {
+			p++;
+		}
+		trace_stats.lines++;
+	}
+}
+
+/* Binary traces ***************************************************************/
+
+static void put_u32(unsigned char* p, uint32_t v) {
+	for( int i = 0; i < 4; i++ ) {
+		p[i] = (unsigned char)(v >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+	put_u32(p, (uint32_t)v);
+	put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static void bad_binary_trace() {
+	fprintf(stderr, "Malformed binary trace file.\n");
+	exit(1);
+}
+
+/* checks a binary trace header, returns how many records its blocks hold */
+static uint32_t check_binary_header(const unsigned char* header) {
+	uint32_t block_records;
+
+	if( get_u32(header + 4) != BINARY_TRACE_VERSION ) {
+		fprintf(stderr, "Unsupported binary trace version %u.\n", get_u32(header + 4));
+		exit(1);
+	}
+	block_records = get_u32(header + 8);
+	if( block_records == 0 || block_records > BINARY_TRACE_MAX_RECORDS ) {
+		bad_binary_trace();
+	}
+	return block_records;
+}
+
+/* decodes the records of one block (everything after its 8-byte block header)
+and hands each access to access_handler. Returns the bytes it used */
+static size_t decode_binary_block(const unsigned char* p, size_t size, uint32_t count) {
+	const unsigned char* types = p;
+	const unsigned char* q = p + (count + 3) / 4;
+	const unsigned char* end = p + size;
+	memaddr_t previous[2] = { 0, 0 };	// last I-stream and D-stream address
+
+	if( q > end ) {
+		bad_binary_trace();
+	}
+
+	for( uint32_t i = 0; i < count; i++ ) {
+		AccessType type = (AccessType)((types[i >> 2] >> ((i & 3) * 2)) & 3);
+		int stream = (type != Access_I_FETCH);
+		uint64_t zigzag = 0;
+		int shift = 0;
+		unsigned char byte;
+
+		do {
+			if( q == end || shift > 63 ) {
+				bad_binary_trace();
+			}
+			byte = *q++;
+			zigzag |= (uint64_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while( byte & 0x80 );
+
+		if( type > Access_D_WRITE ) {
+			bad_binary_trace();
+		}
+		previous[stream] += (memaddr_t)((zigzag >> 1) ^ -(zigzag & 1));
+		access_handler(type, previous[stream]);
+	}
+	trace_stats.lines += count;
+	return q - p;
+}
+
+/* decodes a whole binary trace sitting in memory */
+static void read_binary_buffer(const unsigned char* p, size_t size) {
+	const unsigned char* end = p + size;
+	uint32_t block_records;
+
+	if( size < BINARY_TRACE_HEADER_SIZE ) {
+		bad_binary_trace();
+	}
+	block_records = check_binary_header(p);
+	p += BINARY_TRACE_HEADER_SIZE;
+
+	while( p < end && !trace_stopped ) {
+		uint32_t count, payload;
+
+		if( end - p < 8 ) {
+			bad_binary_trace();
+		}
+		count = get_u32(p);
+		payload = get_u32(p + 4);
+		p += 8;
+		if( count > block_records || payload > (size_t)(end - p) ) {
+			bad_binary_trace();
+		}
+		decode_binary_block(p, payload, count);
+		p += payload;
+	}
+}
+
+/* the bytes open_trace read to recognise a trace it couldn't seek back over
+(a pipe, or stdin), which the stream readers take before the rest of it */
+static unsigned char trace_pushback[6];
+static size_t pushback_length = 0;
+
+/* fread from a trace stream, starting with what open_trace pushed back */
+static size_t trace_fread(void* buffer, size_t size, FILE* trace) {
+	size_t got = pushback_length < size ? pushback_length : size;
+
+	memcpy(buffer, trace_pushback, got);
+	pushback_length -= got;
+	memmove(trace_pushback, trace_pushback + got, pushback_length);
+	if( got < size ) {
+		got += fread((char*)buffer + got, 1, size - got, trace);
+	}
+	return got;
+}
+
+/* decodes a binary trace one block at a time from a stream, e.g. a pipe */
+static void read_binary_stream(FILE* trace) {
+	unsigned char header[BINARY_TRACE_HEADER_SIZE];
+	unsigned char* block;
+	uint32_t block_records;
+
+	if( trace_fread(header, sizeof(header), trace) != sizeof(header) ) {
+		bad_binary_trace();
+	}
+	block_records = check_binary_header(header);
+	trace_stats.bytes += sizeof(header);
+
+	block = malloc(BINARY_TRACE_MAX_BLOCK(block_records));
+	while( !trace_stopped ) {
+		unsigned char block_header[8];
+		uint32_t count, payload;
+		size_t got = trace_fread(block_header, sizeof(block_header), trace);
+
+		if( got == 0 ) {
+			break;
+		}
+		if( got != sizeof(block_header) ) {
+			bad_binary_trace();
+		}
+		count = get_u32(block_header);
+		payload = get_u32(block_header + 4);
+		if( count > block_records || payload > BINARY_TRACE_MAX_BLOCK(block_records) ||
+			trace_fread(block, payload, trace) != payload ) {
+			bad_binary_trace();
+		}
+		decode_binary_block(block, payload, count);
+		trace_stats.bytes += sizeof(block_header) + payload;
+	}
+	free(block);
+}
+
+/* state of the binary trace being written by cachesim convert */
+struct BinaryWriter
+{
+	FILE* out;
+	unsigned char* block;	// type bits, then the varints
+	unsigned char* payload;
+	unsigned char* cursor;
+	uint32_t count;
+	memaddr_t previous[2];
+	uint64_t records;
+	uint64_t blocks;
+	uint64_t bytes;
+};
+
+static struct BinaryWriter writer;
+
+static void binary_writer_flush() {
+	unsigned char block_header[8];
+	size_t type_bytes = (writer.count + 3) / 4;
+	size_t varint_bytes = writer.cursor - writer.payload;
+
+	if( writer.count == 0 ) {
+		return;
+	}
+
+	/* slide the varints down to sit right after the type bits actually used */
+	memmove(writer.block + type_bytes, writer.payload, varint_bytes);
+	put_u32(block_header, writer.count);
+	put_u32(block_header + 4, (uint32_t)(type_bytes + varint_bytes));
+	if( fwrite(block_header, 1, 8, writer.out) != 8 ||
+		fwrite(writer.block, 1, type_bytes + varint_bytes, writer.out) != type_bytes + varint_bytes ) {
+		fprintf(stderr, "Could not write binary trace.\n");
+		exit(1);
+	}
+
+	writer.bytes += 8 + type_bytes + varint_bytes;
+	writer.blocks++;
+	writer.count = 0;
+	writer.previous[0] = writer.previous[1] = 0;	// blocks decode on their own
+	memset(writer.block, 0, BINARY_TRACE_RECORDS / 4);
+	writer.cursor = writer.payload;
+}
+
+/* access_handler while converting: append one access to the current block */
+static void binary_writer_append(AccessType type, memaddr_t address) {
+	int stream = (type != Access_I_FETCH);
+	int64_t delta = (int64_t)(address - writer.previous[stream]);
+	uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+
+	writer.block[writer.count >> 2] |= (unsigned char)(type << ((writer.count & 3) * 2));
+	while( zigzag >= 0x80 ) {
+		*writer.cursor++ = (unsigned char)(zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	*writer.cursor++ = (unsigned char)zigzag;
+	writer.previous[stream] = address;
+	writer.records++;
+
+	if( ++writer.count == BINARY_TRACE_RECORDS ) {
+		binary_writer_flush();
+	}
+}
+
+static void write_binary_header() {
+	unsigned char header[BINARY_TRACE_HEADER_SIZE] = { 0 };
+
+	memcpy(header, BINARY_TRACE_MAGIC, 4);
+	put_u32(header + 4, BINARY_TRACE_VERSION);
+	put_u32(header + 8, BINARY_TRACE_RECORDS);
+	put_u64(header + 16, writer.records);
+	put_u64(header + 24, writer.blocks);
+	if( fwrite(header, 1, sizeof(header), writer.out) != sizeof(header) ) {
+		fprintf(stderr, "Could not write binary trace.\n");
+		exit(1);
+	}
+}
+
+static int is_binary_trace(const void* start, size_t size) {
+	return size >= 4 && memcmp(start, BINARY_TRACE_MAGIC, 4) == 0;
+}
+
+/* Compressed traces ***********************************************************/
+
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+static pid_t decompressor_pid = 0;
+
+/* reads a stream in big chunks and scans every complete line in each one,
+carrying a partial last line over to the next chunk */
+static void read_trace_stream(FILE* trace) {
+	char* buffer = malloc(STREAM_BUFFER_SIZE);
+	size_t carry = 0;
+
+	while( !trace_stopped ) {
+		size_t got = trace_fread(buffer + carry, STREAM_BUFFER_SIZE - carry, trace);
+		size_t filled = carry + got;
+		char* last;
+
+		trace_stats.bytes += got;
+		if( got == 0 ) {
+			scan_trace_buffer(buffer, buffer + carry);	// last line had no newline
+			break;
+		}
+
+		last = memrchr(buffer, '\n', filled);
+		if( last == NULL ) {	// one huge line, nothing to carry over
+			last = buffer + filled - 1;
+		}
+		scan_trace_buffer(buffer, last + 1);
+		carry = buffer + filled - (last + 1);
+		memmove(buffer, last + 1, carry);
+	}
+	free(buffer);
+}
+
+/* number of members in a zip archive, from its end of central directory
+record, or -1 if that can't be found */
+static int zip_member_count(FILE* archive) {
+	unsigned char tail[65536 + 22];
+	long size;
+	size_t got;
+
+	if( fseek(archive, 0, SEEK_END) != 0 || (size = ftell(archive)) < 22 ) {
+		return -1;
+	}
+	got = size < (long)sizeof(tail) ? (size_t)size : sizeof(tail);
+	if( fseek(archive, size - (long)got, SEEK_SET) != 0 || fread(tail, 1, got, archive) != got ) {
+		return -1;
+	}
+	for( size_t i = got - 22 + 1; i-- > 0; ) {	// the record ends with a comment, search back
+		if( get_u32(tail + i) == 0x06054b50 ) {
+			return tail[i + 10] | tail[i + 11] << 8;
+		}
+	}
+	return -1;
+}
+
+/* copies what open_trace pushed back and the rest of a stream it couldn't
+seek back over into fd, for a decompressor to read */
+static void feed_decompressor(FILE* archive, int fd) {
+	char buffer[65536];
+	size_t got;
+
+	while( (got = trace_fread(buffer, sizeof(buffer), archive)) > 0 ) {
+		for( size_t done = 0; done < got; ) {
+			ssize_t wrote = write(fd, buffer + done, got - done);
+			if( wrote <= 0 ) {
+				return;	// the decompressor gave up, it says why
+			}
+			done += (size_t)wrote;
+		}
+	}
+}
+
+/* runs a decompressor with the archive on its stdin (or named in argv) and
+returns the read end of its output. If open_trace had to read the archive's
+first bytes off a pipe, a child of the decompressor's feeds it them and the
+rest of the pipe */
+static FILE* spawn_decompressor(char* const* argv, FILE* archive) {
+	int out[2];
+	FILE* stream;
+
+	fflush(stdout);
+	if( pipe(out) != 0 || (decompressor_pid = fork()) < 0 ) {
+		bad_params("Could not start the trace decompressor.");
+	}
+
+	if( decompressor_pid == 0 ) {
+		int in[2];
+		pid_t feeder;
+
+		if( pushback_length == 0 ) {
+			dup2(fileno(archive), 0);
+		} else if( pipe(in) != 0 || (feeder = fork()) < 0 ) {
+			fprintf(stderr, "Could not start the trace decompressor.\n");
+			_exit(127);
+		} else if( feeder == 0 ) {
+			close(in[0]);
+			close(out[0]);
+			close(out[1]);
+			feed_decompressor(archive, in[1]);
+			_exit(0);
+		} else {
+			dup2(in[0], 0);
+			close(in[0]);
+			close(in[1]);
+		}
+		dup2(out[1], 1);
+		close(out[0]);
+		close(out[1]);
+		execvp(argv[0], argv);
+		fprintf(stderr, "Could not run %s to decompress the trace.\n", argv[0]);
+		_exit(127);
+	}
+
+	close(out[1]);
+	fclose(archive);
+	pushback_length = 0;	// the feeder has it
+	stream = fdopen(out[0], "r");
+	if( stream == NULL ) {
+		bad_params("Could not read from the trace decompressor.");
+	}
+	return stream;
+}
+
+/*
+Opens a trace for reading. "-" is stdin. Compressed traces are recognised by
+their magic bytes and come back as the output of a decompressor, streamed
+through a pipe so nothing gets unpacked to disk. "archive.zip:member" picks
+one trace out of a zip archive; a zip with just one trace doesn't need it.
+A trace that can't be seeked back over (a pipe, <(...), stdin) keeps the magic
+bytes in trace_pushback for whatever reads it next. Returns NULL if the trace
+can't be opened.
+*/
+FILE* open_trace(const char* name) {
+	unsigned char magic[6] = { 0 };
+	char* archive_name = NULL;
+	const char* member = NULL;
+	FILE* trace;
+	size_t got;
+	int seekable;
+
+	if( strcmp(name, "-") == 0 ) {
+		trace = stdin;
+	} else {
+		trace = fopen(name, "rb");
+	}
+	if( trace == NULL && strrchr(name, ':') != NULL ) {
+		archive_name = strdup(name);
+		*strrchr(archive_name, ':') = '\0';
+		member = strrchr(name, ':') + 1;
+		trace = fopen(archive_name, "rb");
+	}
+	if( trace == NULL ) {
+		return NULL;
+	}
+
+	seekable = lseek(fileno(trace), 0, SEEK_CUR) >= 0;
+	got = fread(magic, 1, sizeof(magic), trace);
+	if( !seekable ) {
+		memcpy(trace_pushback, magic, got);
+		pushback_length = got;
+	} else if( fseek(trace, 0, SEEK_SET) != 0 ) {
+		bad_params("Could not read the trace file.");
+	}
+
+	if( member != NULL || memcmp(magic, "PK\3\4", 4) == 0 ) {
+		char* argv[] = { "unzip", "-p", "-qq", archive_name ? archive_name : (char*)name, (char*)member, NULL };
+		int members;
+
+		if( memcmp(magic, "PK\3\4", 4) != 0 ) {
+			bad_params("Only zip archives can have a member named after ':'.");
+		}
+		if( !seekable || trace == stdin ) {
+			bad_params("A zip archive has to be given as a file, not piped in.");
+		}
+		members = zip_member_count(trace);
+		rewind(trace);
+		if( member == NULL && members != 1 ) {
+			bad_params("The zip archive has more than one trace, pick one as archive.zip:member.");
+		}
+		trace = spawn_decompressor(argv, trace);
+	} else if( magic[0] == 0x1f && magic[1] == 0x8b ) {
+		char* argv[] = { "gzip", "-dc", NULL };
+		trace = spawn_decompressor(argv, trace);
+	} else if( memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0 ) {
+		char* argv[] = { "zstd", "-dcq", NULL };
+		trace = spawn_decompressor(argv, trace);
+	} else if( memcmp(magic, "\xfd" "7zXZ\0", 6) == 0 ) {
+		char* argv[] = { "xz", "-dc", NULL };
+		trace = spawn_decompressor(argv, trace);
+	}
+
+	free(archive_name);
+	return trace;
+}
+
+/* closes a trace, and checks that its decompressor (if any) finished cleanly.
+One cut off by --stop-after can't have */
+void close_trace(FILE* trace) {
+	int status;
+
+	fclose(trace);
+	if( decompressor_pid > 0 ) {
+		if( (waitpid(decompressor_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) &&
+			!trace_stopped ) {
+			fprintf(stderr, "Decompressing the trace failed.\n");
+			exit(1);
+		}
+		decompressor_pid = 0;
+	}
+}
+
+/* maps a regular trace file and scans or decodes it in place. Returns 0 if
+the trace can't be mapped (a pipe, say) so the caller falls back to streaming
+it through stdio */
+int read_trace_mapped(FILE* trace) {
+	struct stat st;
+	char* map;
+
+	if( fstat(fileno(trace), &st) != 0 || !S_ISREG(st.st_mode) ) {
+		return 0;
+	}
+	if( st.st_size == 0 ) {
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(trace), 0);
+	if( map == MAP_FAILED ) {
+		return 0;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if( is_binary_trace(map, st.st_size) ) {
+		read_binary_buffer((const unsigned char*)map, st.st_size);
+	} else {
+		scan_trace_buffer(map, map + st.st_size);
+	}
+	trace_stats.bytes += st.st_size;
+
+	munmap(map, st.st_size);
+	return 1;
+}
+
+/* runs the whole trace through the simulator, timing the reader */
+void read_trace(FILE* trace) {
+	double start = now_seconds();
+
+	hex_table_setup();
+	if( checkpoint_file != NULL || restore_file != NULL || stop_after != 0 ) {
+		positioned_handler = access_handler;
+		access_handler = positioned_access;
+	}
+	if( !read_trace_mapped(trace) ) {
+		int first = pushback_length ? trace_pushback[0] : getc(trace);	// no text line starts with the magic's 'C'
+
+		if( first != EOF && pushback_length == 0 ) {
+			ungetc(first, trace);
+		}
+		if( first == BINARY_TRACE_MAGIC[0] ) {
+			read_binary_stream(trace);
+		} else {
+			read_trace_stream(trace);
+		}
+	}
+	if( access_handler == positioned_access ) {
+		finish_positions();
+	}
+	trace_stats.seconds = now_seconds() - start;
+
+	if( report_trace_stats ) {
+		double mb = trace_stats.bytes / 1e6;
+		double seconds = trace_stats.seconds > 0 ? trace_stats.seconds : 1e-9;
+		fprintf(stderr, "Trace: %lu lines, %.1f MB in %.3f s (%.1f MB/s, %.0f lines/s)%s\n",
+			trace_stats.lines, mb, trace_stats.seconds, mb / seconds,
+			trace_stats.lines / seconds, parse_only ? ", parse only" : "");
+	}
+}
+
+/*
+cachesim convert in.txt out.cstb
+Turns a text trace into a binary one. The input can be anything the simulator
+reads, so converting a binary trace just re-encodes it.
+*/
+int convert_trace(int argc, char** argv) {
+	FILE* trace;
+
+	if( argc != 4 ) {
+		fprintf(stderr, "Usage: %s convert <trace in> <binary trace out>\n", argv[0]);
+		return 1;
+	}
+
+	trace = open_trace(argv[2]);
+	if( trace == NULL ) {
+		fprintf(stderr, "Could not open trace file.\n");
+		return 1;
+	}
+	writer.out = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+	if( writer.out == NULL ) {
+		fprintf(stderr, "Could not open binary trace file for writing.\n");
+		return 1;
+	}
+
+	writer.block = calloc(1, BINARY_TRACE_MAX_BLOCK(BINARY_TRACE_RECORDS));
+	writer.payload = writer.block + BINARY_TRACE_RECORDS / 4;
+	writer.cursor = writer.payload;
+	write_binary_header();	// counts are filled in once they are known
+
+	access_handler = binary_writer_append;
+	read_trace(trace);
+	binary_writer_flush();
+
+	/* a pipe keeps the zero counts, readers don't need them */
+	if( fseek(writer.out, 0, SEEK_SET) == 0 ) {
+		write_binary_header();
+	}
+	writer.bytes += BINARY_TRACE_HEADER_SIZE;
+
+	fprintf(stderr, "Wrote %llu accesses in %llu blocks, %llu bytes (%.2f bytes/access)\n",
+		(unsigned long long)writer.records, (unsigned long long)writer.blocks,
+		(unsigned long long)writer.bytes,
+		writer.records ? (double)writer.bytes / writer.records : 0.0);
+
+	free(writer.block);
+	close_trace(trace);
+	return fclose(writer.out) == 0 ? 0 : 1;
+}
+
+/*******************************************************************************
+*
+*
+*
+* DO NOT MODIFY ANYTHING BELOW THIS LINE!
+*
+*
+*
+*******************************************************************************/
+
+void dump_cache_info()
+{
+	int i;
+	CacheInfo* info;
+
+	printf("Instruction cache:\n");
+	printf("\t%d blocks\n", icache_info.num_blocks);
 	printf("\t%d word(s) per block\n", icache_info.words_per_block);
 	printf("\t%d-way associative\n", icache_info.associativity);
 
 	if(icache_info.associativity > 1)
 	{
 		printf("\treplacement: %s\n\n",
-		icache_info.replacement == Replacement_LRU ? "LRU" : "Random");
+		cachesim_replacement_name(icache_info.replacement));
 	}
 	else
 	printf("\n");
@@ -813,8 +2038,7 @@ void dump_cache_info()
 
 		if(info->associativity > 1)
 		{
-			printf("\treplacement: %s\n", info->replacement == Replacement_LRU ?
-			"LRU" : "Random");
+			printf("\treplacement: %s\n", cachesim_replacement_name(info->replacement));
 		}
 
 		printf("\twrite scheme: %s\n", info->write_scheme == Write_WRITE_BACK ?
@@ -826,43 +2050,215 @@ void dump_cache_info()
 	}
 }
 
-void read_trace_line(FILE* trace)
+static void bad_params(const char* msg)
 {
-	char line[100];
-	memaddr_t address;
-	char type;
+	if(sweep_line > 0)
+	fprintf(stderr, "Sweep file line %d: ", sweep_line);
+	fprintf(stderr, msg);
+	fprintf(stderr, "\n");
+	exit(1);
+}
 
-	if(fgets(line, sizeof(line), trace) == NULL)
-	{
-		return;
-	}
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+static void parse_icache_params(const char* params, CacheInfo* info)
+{
+	char replace_scheme;
+	int converted;
 
-	if(sscanf(line, "0x%lx %c", &address, &type) < 2)
+	if(params == NULL)
+	bad_params("Expected parameters after -I.");
+
+	converted = sscanf(params, "%d:%d:%d:%c",
+	&info->num_blocks,
+	&info->words_per_block,
+	&info->associativity,
+	&replace_scheme);
+
+	if(converted < 4)
+	bad_params("Invalid I-cache parameters.");
+
+	if(info->associativity > 1)
 	{
-		return;
+		int replacement = cachesim_replacement_from_letter(replace_scheme);
+		if(replacement < 0)
+		bad_params("Invalid I-cache replacement scheme.");
+		info->replacement = (ReplacementType)replacement;
 	}
+}
 
-	switch(type)
+static void parse_dcache_params(const char* params, CacheInfo* info, int* have_data)
+{
+	int level;
+	int num_blocks;
+	int words_per_block;
+	int associativity;
+	char write_scheme;
+	char alloc_scheme;
+	char replace_scheme;
+	int converted;
+
+	if(params == NULL)
+	bad_params("Expected parameters after -D.");
+
+	converted = sscanf(params, "%d:%d:%d:%d:%c:%c:%c",
+	&level, &num_blocks, &words_per_block, &associativity,
+	&replace_scheme, &write_scheme, &alloc_scheme);
+
+	if(converted < 7)
+	bad_params("Invalid D-cache parameters.");
+
+	if(level < 1 || level > 3)
+	bad_params("Inalid D-cache level.");
+
+	level--;
+	if(have_data[level])
+	bad_params("Duplicate D-cache level parameters.");
+
+	have_data[level] = 1;
+
+	info[level].num_blocks = num_blocks;
+	info[level].words_per_block = words_per_block;
+	info[level].associativity = associativity;
+
+	if(associativity > 1)
 	{
-		case 'R': handle_access(Access_D_READ, address);  break;
-		case 'W': handle_access(Access_D_WRITE, address); break;
-		case 'I': handle_access(Access_I_FETCH, address); break;
-		default:
-		fprintf(stderr, "Malformed trace file: invalid access type '%c'.\n",
-		type);
-		exit(1);
-		break;
+		int replacement = cachesim_replacement_from_letter(replace_scheme);
+		if(replacement < 0)
+		bad_params("Invalid D-cache replacement scheme.");
+		info[level].replacement = (ReplacementType)replacement;
 	}
+
+	if(write_scheme == 'B')
+	info[level].write_scheme = Write_WRITE_BACK;
+	else if(write_scheme == 'T')
+	info[level].write_scheme = Write_WRITE_THROUGH;
+	else
+	bad_params("Invalid D-cache write scheme.");
+
+	if(alloc_scheme == 'A')
+	info[level].allocate_scheme = Allocate_ALLOCATE;
+	else if(alloc_scheme == 'N')
+	info[level].allocate_scheme = Allocate_NO_ALLOCATE;
+	else
+	bad_params("Invalid D-cache allocation scheme.");
 }
 
-static void bad_params(const char* msg)
+static void parse_prefetch_params(const char* params, PrefetchInfo* info)
 {
-	fprintf(stderr, msg);
-	fprintf(stderr, "\n");
-	exit(1);
+	char kind[8];
+	int converted;
+
+	info->degree = 1;
+	info->distance = 1;
+	converted = sscanf(params, "%7[a-z]:%d:%d", kind, &info->degree, &info->distance);
+
+	if(converted < 1)
+	bad_params("Expected next, stride or stream after --prefetch-i/--prefetch-d.");
+
+	if(streq(kind, "next"))
+	info->type = Prefetch_NEXT_LINE;
+	else if(streq(kind, "stride"))
+	info->type = Prefetch_STRIDE;
+	else if(streq(kind, "stream"))
+	info->type = Prefetch_STREAM;
+	else
+	bad_params("Expected next, stride or stream after --prefetch-i/--prefetch-d.");
+
+	if(info->degree < 1 || info->distance < 1)
+	bad_params("Invalid prefetch degree or distance.");
 }
 
-#define streq(a, b) (strcmp((a), (b)) == 0)
+/* --time-sample W:P[:U] */
+static void parse_time_sample_params(const char* params, struct cachesim_options* options)
+{
+	unsigned long long window, period, warmup;
+	int fields;
+	char extra;
+
+	fields = sscanf(params, "%llu:%llu:%llu%c", &window, &period, &warmup, &extra);
+	if(fields != 2 && fields != 3)
+	bad_params("Expected WINDOW:PERIOD[:WARMUP] after --time-sample.");
+
+	if(window == 0 || period < window)
+	bad_params("The time sampling window must be non-empty and fit in the period.");
+
+	if(fields == 2)
+	warmup = period - window;
+
+	if(warmup > period - window)
+	bad_params("The time sampling warm-up must fit in the period with the window.");
+
+	options->sample_window = window;
+	options->sample_period = period;
+	options->sample_warmup = warmup;
+}
+
+static void check_cache_params(int have_inst, const int* have_data)
+{
+	if(!have_inst)
+	bad_params("No I-cache parameters specified.");
+
+	if(have_data[1] && !have_data[0])
+	bad_params("L2 D-cache specified, but not L1.");
+
+	if(have_data[2] && !have_data[1])
+	bad_params("L3 D-cache specified, but not L2.");
+}
+
+/* reads a --sweep file: one configuration per line, written with the same
+-I and -D parameters as the command line. # starts a comment */
+static void load_sweep(const char* filename)
+{
+	FILE* sweep = fopen(filename, "r");
+	char line[1024];
+	int line_number = 0;
+
+	if(sweep == NULL)
+	bad_params("Could not open sweep file.");
+
+	while(fgets(line, sizeof(line), sweep) != NULL)
+	{
+		CacheInfo inst = {};
+		CacheInfo data[3] = {};
+		int have_inst = 0;
+		int have_data[3] = {};
+		char* name;
+		char* token;
+
+		line_number++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		name = line + strspn(line, " \t");
+		if(*name == '\0')
+		continue;
+		name = strdup(name);
+
+		sweep_line = line_number;
+		for(token = strtok(line, " \t"); token != NULL; token = strtok(NULL, " \t"))
+		{
+			if(streq(token, "-I"))
+			{
+				if(have_inst)
+				bad_params("Duplicate I-cache parameters.");
+				have_inst = 1;
+				parse_icache_params(strtok(NULL, " \t"), &inst);
+			}
+			else if(streq(token, "-D"))
+			parse_dcache_params(strtok(NULL, " \t"), data, have_data);
+			else
+			bad_params("Expected -I or -D parameters.");
+		}
+		check_cache_params(have_inst, have_data);
+		sweep_line = 0;
+
+		add_simulator(&inst, data, name);
+	}
+
+	if(num_simulators == 0)
+	bad_params("The sweep file has no configurations.");
+
+	fclose(sweep);
+}
 
 FILE* parse_arguments(int argc, char** argv)
 {
@@ -870,14 +2266,6 @@ FILE* parse_arguments(int argc, char** argv)
 	int have_inst = 0;
 	int have_data[3] = {};
 	FILE* trace = NULL;
-	int level;
-	int num_blocks;
-	int words_per_block;
-	int associativity;
-	char write_scheme;
-	char alloc_scheme;
-	char replace_scheme;
-	int converted;
 
 	for(i = 1; i < argc; i++)
 	{
@@ -891,74 +2279,253 @@ FILE* parse_arguments(int argc, char** argv)
 			have_inst = 1;
 
 			i++;
-			converted = sscanf(argv[i], "%d:%d:%d:%c",
-			&icache_info.num_blocks,
-			&icache_info.words_per_block,
-			&icache_info.associativity,
-			&replace_scheme);
+			parse_icache_params(argv[i], &icache_info);
+		}
+		else if(streq(argv[i], "-D"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected parameters after -D.");
+
+			i++;
+			parse_dcache_params(argv[i], dcache_info, have_data);
+		}
+		else if(streq(argv[i], "--sweep"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a file name after --sweep.");
+
+			if(num_simulators > 0)
+			bad_params("Duplicate --sweep.");
+
+			i++;
+			load_sweep(argv[i]);
+		}
+		else if(streq(argv[i], "--threads"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a thread count after --threads.");
+
+			i++;
+			num_threads = atoi(argv[i]);
+			if(num_threads == 0)
+			num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+			if(num_threads < 1)
+			bad_params("Invalid thread count.");
+		}
+		else if(streq(argv[i], "--address-bits"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected 32, 48 or 64 after --address-bits.");
+
+			i++;
+			sim_options.address_bits = atoi(argv[i]);
+			if(sim_options.address_bits != 32 && sim_options.address_bits != 48 &&
+			sim_options.address_bits != 64)
+			bad_params("Expected 32, 48 or 64 after --address-bits.");
+		}
+		else if(streq(argv[i], "--seed"))
+		{
+			char* end;
+
+			if(i == (argc - 1))
+			bad_params("Expected a number after --seed.");
+
+			i++;
+			sim_options.seed = strtoull(argv[i], &end, 0);
+			if(*argv[i] == '\0' || *end != '\0')
+			bad_params("Invalid seed.");
+		}
+		else if(streq(argv[i], "--simd"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected scalar, sse2, avx2, avx512 or auto after --simd.");
+
+			i++;
+			sim_options.simd = argv[i];
+			if(!streq(argv[i], "scalar") && !streq(argv[i], "sse2") &&
+			!streq(argv[i], "avx2") && !streq(argv[i], "avx512") &&
+			!streq(argv[i], "auto"))
+			bad_params("Expected scalar, sse2, avx2, avx512 or auto after --simd.");
+		}
+		else if(streq(argv[i], "--prefetch-i") || streq(argv[i], "--prefetch-d"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected next, stride or stream after --prefetch-i/--prefetch-d.");
+
+			i++;
+			parse_prefetch_params(argv[i], streq(argv[i - 1], "--prefetch-i") ?
+			&sim_options.icache_prefetch : &sim_options.dcache_prefetch);
+		}
+		else if(streq(argv[i], "--prefetch-latency"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a number of accesses after --prefetch-latency.");
+
+			i++;
+			sim_options.prefetch_latency = atoi(argv[i]);
+			if(sim_options.prefetch_latency < 1)
+			bad_params("Invalid prefetch latency.");
+		}
+		else if(streq(argv[i], "--victim"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a number of blocks after --victim.");
+
+			i++;
+			sim_options.victim_blocks = atoi(argv[i]);
+			if(sim_options.victim_blocks < 1)
+			bad_params("Invalid victim cache size.");
+		}
+		else if(streq(argv[i], "--wbuf"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a number of entries after --wbuf.");
 
-			if(converted < 4)
-			bad_params("Invalid I-cache parameters.");
+			i++;
+			sim_options.write_buffer_entries = atoi(argv[i]);
+			if(sim_options.write_buffer_entries < 1)
+			bad_params("Invalid write buffer size.");
+		}
+		else if(streq(argv[i], "--heatmap") || streq(argv[i], "--hot-blocks"))
+		{
+			FILE** out = streq(argv[i], "--heatmap") ? &heatmap_file : &hot_blocks_file;
+
+			if(i == (argc - 1))
+			bad_params("Expected a file name after --heatmap/--hot-blocks.");
 
-			if(icache_info.associativity > 1)
+			i++;
+			if(*out != NULL)
+			bad_params("Duplicate --heatmap/--hot-blocks.");
+			*out = fopen(argv[i], "w");
+			if(*out == NULL)
+			bad_params("Could not open the --heatmap/--hot-blocks file.");
+			if(out == &heatmap_file)
 			{
-				if(replace_scheme == 'R')
-				icache_info.replacement = Replacement_RANDOM;
-				else if(replace_scheme == 'L')
-				icache_info.replacement = Replacement_LRU;
-				else
-				bad_params("Invalid I-cache replacement scheme.");
+				heatmap_json = is_json_name(argv[i]);
+				sim_options.instrument = 1;
 			}
+			else
+			hot_blocks_json = is_json_name(argv[i]);
 		}
-		else if(streq(argv[i], "-D"))
+		else if(streq(argv[i], "--top"))
 		{
 			if(i == (argc - 1))
-			bad_params("Expected parameters after -D.");
+			bad_params("Expected a number of blocks after --top.");
+
+			i++;
+			top_blocks = atoi(argv[i]);
+			if(top_blocks < 1 || top_blocks > 1024)
+			bad_params("Expected 1 to 1024 blocks after --top.");
+		}
+		else if(streq(argv[i], "--mrc"))
+		{
+			mrc_mode = 1;
+			access_handler = mrc_access;
+		}
+		else if(streq(argv[i], "--sample-sets"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a number of sets after --sample-sets.");
 
 			i++;
-			converted = sscanf(argv[i], "%d:%d:%d:%d:%c:%c:%c",
-			&level, &num_blocks, &words_per_block, &associativity,
-			&replace_scheme, &write_scheme, &alloc_scheme);
+			sim_options.sample_sets = atoi(argv[i]);
+			if(sim_options.sample_sets < 1 || (sim_options.sample_sets & (sim_options.sample_sets - 1)) != 0)
+			bad_params("Expected a power of two after --sample-sets.");
+		}
+		else if(streq(argv[i], "--time-sample"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected WINDOW:PERIOD after --time-sample.");
 
-			if(converted < 7)
-			bad_params("Invalid D-cache parameters.");
+			i++;
+			parse_time_sample_params(argv[i], &sim_options);
+		}
+		else if(streq(argv[i], "--intervals"))
+		{
+			size_t length;
 
-			if(level < 1 || level > 3)
-			bad_params("Inalid D-cache level.");
+			if(i == (argc - 1))
+			bad_params("Expected a file name after --intervals.");
 
-			level--;
-			if(have_data[level])
-			bad_params("Duplicate D-cache level parameters.");
+			i++;
+			interval_file = fopen(argv[i], "w");
+			if(interval_file == NULL)
+			bad_params("Could not create the --intervals file.");
 
-			have_data[level] = 1;
+			length = strlen(argv[i]);
+			interval_json = is_json_name(argv[i]) || (length >= 6 && streq(argv[i] + length - 6, ".jsonl"));
+		}
+		else if(streq(argv[i], "--interval") || streq(argv[i], "--warmup"))
+		{
+			uint64_t* count = streq(argv[i], "--interval") ? &interval_length : &warmup_accesses;
+			char* end;
 
-			dcache_info[level].num_blocks = num_blocks;
-			dcache_info[level].words_per_block = words_per_block;
-			dcache_info[level].associativity = associativity;
+			if(i == (argc - 1))
+			bad_params("Expected a number of accesses after --interval/--warmup.");
 
-			if(associativity > 1)
+			i++;
+			*count = strtoull(argv[i], &end, 0);
+			if(count == &interval_length && *end == 'i')
 			{
-				if(replace_scheme == 'R')
-				dcache_info[level].replacement = Replacement_RANDOM;
-				else if(replace_scheme == 'L')
-				dcache_info[level].replacement = Replacement_LRU;
-				else
-				bad_params("Invalid D-cache replacement scheme.");
+				interval_instructions = 1;
+				end++;
 			}
+			if(*argv[i] == '\0' || *end != '\0' || *count == 0)
+			bad_params("Invalid number of accesses after --interval/--warmup.");
+		}
+		else if(streq(argv[i], "--checkpoint") || streq(argv[i], "--restore"))
+		{
+			if(i == (argc - 1))
+			bad_params("Expected a file name after --checkpoint/--restore.");
 
-			if(write_scheme == 'B')
-			dcache_info[level].write_scheme = Write_WRITE_BACK;
-			else if(write_scheme == 'T')
-			dcache_info[level].write_scheme = Write_WRITE_THROUGH;
+			i++;
+			if(streq(argv[i - 1], "--checkpoint"))
+			checkpoint_file = argv[i];
 			else
-			bad_params("Invalid D-cache write scheme.");
+			restore_file = argv[i];
+		}
+		else if(streq(argv[i], "--stop-after"))
+		{
+			char* end;
+
+			if(i == (argc - 1))
+			bad_params("Expected a number of accesses after --stop-after.");
 
-			if(alloc_scheme == 'A')
-			dcache_info[level].allocate_scheme = Allocate_ALLOCATE;
-			else if(alloc_scheme == 'N')
-			dcache_info[level].allocate_scheme = Allocate_NO_ALLOCATE;
+			i++;
+			stop_after = strtoull(argv[i], &end, 0);
+			if(*argv[i] == '\0' || *end != '\0' || stop_after == 0)
+			bad_params("Invalid number of accesses after --stop-after.");
+		}
+		else if(streq(argv[i], "--3c"))
+		{
+			sim_options.classify_misses = 1;
+		}
+		else if(streq(argv[i], "--footprint"))
+		{
+			report_footprint = 1;
+		}
+		else if(streq(argv[i], "--small-pages"))
+		{
+			sim_options.small_pages = 1;
+		}
+		else if(strncmp(argv[i], "--stats=", 8) == 0)
+		{
+			if(streq(argv[i] + 8, "json"))
+			stats_json = 1;
+			else if(streq(argv[i] + 8, "text"))
+			stats_json = 0;
 			else
-			bad_params("Invalid D-cache allocation scheme.");
+			bad_params("Expected --stats=text or --stats=json.");
+		}
+		else if(streq(argv[i], "--trace-stats"))
+		{
+			report_trace_stats = 1;
+		}
+		else if(streq(argv[i], "--parse-only"))
+		{
+			parse_only = 1;
+			access_handler = ignore_access;
+			report_trace_stats = 1;
 		}
 		else
 		{
@@ -969,16 +2536,27 @@ FILE* parse_arguments(int argc, char** argv)
 		}
 	}
 
-	if(!have_inst)
-	bad_params("No I-cache parameters specified.");
+	if(hot_blocks_file != NULL)
+	sim_options.top_blocks = top_blocks;
 
-	if(have_data[1] && !have_data[0])
-	bad_params("L2 D-cache specified, but not L1.");
+	if((interval_file != NULL || warmup_accesses != 0) && mrc_mode)
+	bad_params("--intervals and --warmup don't go with --mrc.");
 
-	if(have_data[2] && !have_data[1])
-	bad_params("L3 D-cache specified, but not L2.");
+	if(warmup_accesses != 0 && sim_options.sample_window != 0)
+	bad_params("--warmup doesn't go with --time-sample, which warms up its windows itself.");
+
+	if((checkpoint_file != NULL || restore_file != NULL) && (num_simulators > 0 || mrc_mode))
+	bad_params("--checkpoint and --restore take a single -I/-D configuration.");
 
-	trace = fopen(argv[argc - 1], "r");
+	if(num_simulators > 0)
+	{
+		if(have_inst || have_data[0])
+		bad_params("Give the caches with either --sweep or -I/-D, not both.");
+	}
+	else if(!mrc_mode)
+	check_cache_params(have_inst, have_data);
+
+	trace = open_trace(argv[argc - 1]);
 
 	if(trace == NULL)
 	bad_params("Could not open trace file.");
@@ -988,15 +2566,81 @@ FILE* parse_arguments(int argc, char** argv)
 
 int main(int argc, char** argv)
 {
+	if(argc > 1 && streq(argv[1], "convert"))
+	return convert_trace(argc, argv);
+
 	FILE* trace = parse_arguments(argc, argv);
 
+	if(mrc_mode)
+	{
+		setup_mrc();
+		read_trace(trace);
+		close_trace(trace);
+		print_mrc();
+		return 0;
+	}
+
 	setup_caches();
 
-	while(!feof(trace))
-	read_trace_line(trace);
+	if(restore_file != NULL)
+	restore_checkpoint();
 
-	fclose(trace);
+	int intervals = !parse_only && (interval_file != NULL || warmup_accesses != 0);
+
+	if(intervals)
+	{
+		setup_intervals();
+		access_handler = interval_access;
+	}
+
+	if(num_threads > 1 && !parse_only && !intervals && (num_simulators > 1 || can_shard(&simulators[0])))
+	{
+		access_handler = record_access;
+		read_trace(trace);
+		if(num_simulators > 1)
+		run_parallel_sweep();
+		else
+		run_sharded_simulation();
+	}
+	else
+	{
+		read_trace(trace);
+		simulate_batch();
+		if(intervals)
+		finish_intervals();
+	}
+
+	close_trace(trace);
+
+	if(checkpoint_file != NULL)
+	save_checkpoint();
+
+	if(stats_json)
+	{
+		printf("[\n");
+		for(int i = 0; i < num_simulators; i++)
+		print_statistics_json(&simulators[i], i == 0);
+		printf("\n]\n");
+	}
+	else
+	{
+		for(int i = 0; i < num_simulators; i++)
+		print_statistics(&simulators[i]);
+	}
+
+	if(interval_file != NULL)
+	fclose(interval_file);
+
+	if(heatmap_file != NULL)
+	{
+		write_heatmap(heatmap_file, heatmap_json);
+		fclose(heatmap_file);
+	}
 
-	print_statistics();
+	if(hot_blocks_file != NULL)
+	{
+		write_hot_blocks(hot_blocks_file, hot_blocks_json);
+		fclose(hot_blocks_file);
+	}
 	return 0;
 }
@@ -40,6 +40,9 @@ typedef enum
 {
 	Replacement_LRU,
 	Replacement_RANDOM,
+	Replacement_PLRU,
+	Replacement_NRU,
+	Replacement_BIT_PLRU,
 } ReplacementType;
 
 typedef unsigned long memaddr_t;
@@ -60,8 +63,9 @@ If it's anywhere in-between, it's a set-associative cache. The number of sets
 will be num_blocks / associativity, always.
 
 The replacement type is only used when associativity > 1. It can be LRU (least
-recently used) or random. This decides how blocks are "kicked out" of the set/
-cache when a new block needs to be brought in.
+recently used), random, tree pseudo-LRU, NRU (not recently used) or bit
+pseudo-LRU. This decides how blocks are "kicked out" of the set/cache when a new
+block needs to be brought in.
 
 write_scheme and allocate_scheme are only used for the data cache.
 
@@ -97,44 +101,263 @@ void dump_cache_info();
 *
 *******************************************************************************/
 
-void bit_extractor_calculator(int*, int*, int*, int, int);
+#include <stddef.h>
+#include <stdint.h>
 
-void hex_binary_converter(memaddr_t, char**, char*);
+/* counters for one cache, 64 bits so that long traces don't wrap them.
+mem_reads and words_written_to_mem are in words, everything else counts
+accesses.
 
-void address_decompress(char, char*, char*);
+Misses are compulsory_miss + capacity_miss + conflict_miss, write_misses of
+them by writes and the rest by reads (and instruction fetches). By default a miss
+that fills an empty way is compulsory and one that has to kick a block out is a
+conflict miss, and capacity_miss stays 0. With cachesim_options.classify_misses
+they are the 3C: compulsory misses are the first miss on a block, capacity
+misses those a fully-associative LRU cache of as many blocks would have had
+too, and conflict misses the rest.
 
-int row_index_converter(char*);
+The prefetch counters stay 0 without a prefetcher. prefetches is how many
+blocks a prefetcher brought in (their words are in mem_reads; prefetches of
+blocks already in the cache aren't issued). useful_prefetches of those were
+accessed before being kicked out, late_prefetches of the useful ones were
+accessed within prefetch_latency accesses of being issued, before the data
+would have arrived. polluting_prefetches counts misses on blocks a prefetch
+had kicked out.
 
-int word_index_converter(char*);
+victim_hits are misses found in the victim cache, which cost no memory read.
+write_buffer_merges are stores to a block already in the write buffer; only
+the words not already waiting there count in words_written_to_mem */
+struct Stats
+{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t mem_reads;
+	uint64_t words_written_to_mem;
+	uint64_t compulsory_miss;
+	uint64_t conflict_miss;
+	uint64_t capacity_miss;
+	uint64_t write_misses;
+	uint64_t prefetches;
+	uint64_t useful_prefetches;
+	uint64_t late_prefetches;
+	uint64_t polluting_prefetches;
+	uint64_t victim_hits;
+	uint64_t write_buffer_merges;
+};
 
-void add_block(char*, char*, char*, int, char);
+/* what cachesim_metrics works out from a cache's counters. The rates are 0
+when there was nothing to divide by. mpki is misses per thousand
+instructions, counting an instruction per I-cache read, and traffic_bytes the
+bytes read from and written to memory, at 4 a word */
+struct Metrics
+{
+	uint64_t accesses;
+	uint64_t misses;
+	uint64_t read_misses;
+	double miss_rate;
+	double miss_rate_without_compulsory;
+	double read_miss_rate;
+	double write_miss_rate;
+	double mpki;
+	uint64_t traffic_bytes;
+};
 
-void add_block_2(char*, char*, char*, int, int, char);
+/* what an instrumented cache (cachesim_options.instrument) counts per set.
+Hits are accesses - misses; evictions are valid blocks kicked out, by misses or
+prefetches */
+struct SetStats
+{
+	uint64_t accesses;
+	uint64_t misses;
+	uint64_t evictions;
+};
 
-void replace_block(ReplacementType, char*, char*, char*, int, char);
+/* one of the blocks that missed most, from a space-saving sketch: the true
+count is between misses - error and misses */
+struct HotBlock
+{
+	memaddr_t address;	/* of the block's first byte */
+	uint64_t misses;
+	uint64_t error;
+};
 
-void write_to_block(char*, char*, char*, int, int, AllocateType);
+/* one access parsed from a trace */
+struct Access
+{
+	memaddr_t address;
+	AccessType type;
+};
 
-struct Block
+/*
+libcachesim, the simulator as a library (libcachesim.a / libcachesim.so, see
+the Makefile). A cachesim_t is one configuration: an I-cache and the L1 D-cache
+described by CacheInfo, as above. Handles share nothing, so they can be used
+from different threads at once; one handle is only safe on one thread at a
+time (but see cachesim_share).
+*/
+typedef struct cachesim cachesim_t;
+
+typedef enum
+{
+	Prefetch_NONE,
+	Prefetch_NEXT_LINE,	/* the blocks after one that misses */
+	Prefetch_STRIDE,	/* a constant stride between blocks, tracked per 4 KB region */
+	Prefetch_STREAM,	/* runs of neighbouring blocks, up or down */
+} PrefetchType;
+
+/* a prefetcher on one cache. Triggered by a miss, or the first access to a
+block it prefetched (the stride prefetcher watches every access), it fetches
+degree blocks starting distance blocks (or strides) past the one accessed.
+Both default to 1 when 0 */
+typedef struct
 {
-	char byte_select;
-	char* word_bits;
-	char* row_bits;
-	char* tag_bits;
-	int valid;
-	int dirty;
-	int used_last;
+	PrefetchType type;
+	int degree;
+	int distance;
+} PrefetchInfo;
+
+struct cachesim_options
+{
+	uint64_t seed;	/* for random replacement: the I-cache uses seed, the D-cache ~seed */
+	const char* simd;	/* "scalar", "sse2", "avx2" or "avx512" forces a set probe kernel, NULL picks one */
+	int small_pages;	/* don't back big arenas with huge pages */
+	int address_bits;	/* address width, 32 if 0. Bits above it are ignored */
+	PrefetchInfo icache_prefetch;	/* prefetchers, none by default */
+	PrefetchInfo dcache_prefetch;	/* on the L1 D-cache */
+	int prefetch_latency;	/* accesses to a cache a prefetch takes to arrive, 32 if 0 */
+	int victim_blocks;	/* blocks in a victim cache behind the L1 D-cache, none if 0 */
+	int write_buffer_entries;	/* blocks of stores the L1 D-cache's write buffer holds, none if 0 */
+	int instrument;	/* keep SetStats for both caches */
+	int top_blocks;	/* how many most-missing blocks to track in each cache, none if 0 */
+	int classify_misses;	/* count compulsory, capacity and conflict misses exactly (3C) */
+	int sample_sets;	/* simulate only 1 in sample_sets (a power of two) of each cache's sets, all if 0 or 1 */
+	uint64_t sample_window;	/* time sampling, none if 0: of every sample_period accesses, the last */
+	uint64_t sample_period;	/* sample_window are counted and the sample_warmup before them only */
+	uint64_t sample_warmup;	/* simulated to warm the caches; the rest are skipped */
 };
 
-struct Wrapper
+/* dcache_info is the -D levels, of which only the first is simulated. options
+may be NULL for the defaults. Returns NULL if the configuration is invalid or
+doesn't fit in memory, and points *error (if error isn't NULL) at why */
+cachesim_t* cachesim_create(const CacheInfo* icache_info, const CacheInfo* dcache_info,
+	const struct cachesim_options* options, const char** error);
+
+void cachesim_access(cachesim_t*, AccessType, memaddr_t);
+
+/* simulates accesses[0..n) in order, prefetching the sets ahead */
+void cachesim_access_batch(cachesim_t*, const struct Access* accesses, size_t n);
+
+/* copies out the counters; either pointer may be NULL */
+void cachesim_get_stats(const cachesim_t*, struct Stats* icache, struct Stats* dcache);
+
+/* empties both caches, zeroes the counters and reseeds, as if just created */
+void cachesim_reset(cachesim_t*);
+
+/* zeroes the counters (and per-set counters, hot blocks and sampling sums) but
+keeps the caches' contents, to end a warm-up */
+void cachesim_reset_stats(cachesim_t*);
+
+void cachesim_destroy(cachesim_t*);
+
+/* bytes of cache metadata (tags, valid and dirty bits, replacement state) the
+handle keeps, all in one arena; *backing, if backing isn't NULL, says whether it
+got huge pages */
+size_t cachesim_footprint(const cachesim_t*, const char** backing);
+
+/* the set an access maps to in its cache (-1 if that cache is disabled), and
+how many sets that cache has */
+int cachesim_set_of(const cachesim_t*, AccessType, memaddr_t);
+
+int cachesim_num_sets(const cachesim_t*, AccessType);
+
+/* a handle onto the same cache contents with counters of its own, for
+simulating disjoint groups of sets on different threads. Random replacement
+draws from one generator per cache, prefetchers fill other sets than the one
+accessed, and a victim cache, write buffer, the most-missing blocks or 3C
+classification are shared by all the sets, so sharing is only exact without
+any of them (or time sampling, whose windows count every access).
+cachesim_join adds the view's counters back into the handle it came from and
+frees it; destroy the original only after its views */
+cachesim_t* cachesim_share(cachesim_t*);
+
+void cachesim_join(cachesim_t* view);
+
+/* what a sampled run (cachesim_options.sample_sets or sample_window) makes
+of a cache's miss rate: the sample's own, which estimates the whole trace's,
+and the half-width of its 95% confidence interval, negative when fewer than
+two samples (sets, or windows when time sampling) make it up */
+struct MissEstimate
 {
-	struct Block* cache;
-	struct Block** cache2D;
+	double miss_rate;
+	double error;
+	uint64_t samples;
 };
 
-struct Stats
+/* fills in estimate and returns 1, or returns 0 if the handle doesn't sample
+or the cache is disabled */
+int cachesim_estimate(const cachesim_t*, AccessType, struct MissEstimate* estimate);
+
+/* an instrumented handle's per-set counters for a cache: points *sets at one
+per set, valid until the handle is destroyed, and returns how many (0 if the
+handle isn't instrumented or the cache is disabled) */
+int cachesim_set_stats(const cachesim_t*, AccessType, const struct SetStats** sets);
+
+/* copies up to max of the blocks that missed most in a cache into blocks,
+most first, and returns how many */
+int cachesim_hot_blocks(const cachesim_t*, AccessType, struct HotBlock* blocks, int max);
+
+/* where in which trace a checkpoint was taken, which is the caller's to give
+meaning to: cachesim counts the accesses read from the trace so far, and
+hashes all of them, so that a restored run can tell whether it was given the
+same trace */
+struct TracePosition
 {
-	int compulsory_miss;
+	uint64_t accesses;
+	uint64_t hash;
 };
 
+/* checkpoints. cachesim_save writes everything the handle holds (cache
+contents, replacement state, generators, counters) to a file, along with
+position. cachesim_restore puts it all back into a handle created with the
+same configuration and options, and sets *position (if position isn't
+NULL); the cache arrays are mapped copy-on-write from the
+file where they can be, so restoring a big cache is quick and many runs can
+share one checkpoint. Both return NULL, or what went wrong; a failed restore
+leaves the handle as it was, or reset if the arrays were half read. A
+checkpoint is only good for the build of the library that wrote it */
+const char* cachesim_save(const cachesim_t*, const char* path, const struct TracePosition* position);
+
+const char* cachesim_restore(cachesim_t*, const char* path, struct TracePosition* position);
+
+/* works out a cache's metrics from its counters (or the difference between
+two sets of them) and the instructions run meanwhile */
+void cachesim_metrics(const struct Stats*, uint64_t instructions, struct Metrics*);
+
+/* the replacement type a -I/-D letter (L, R, P, N, B) names, or -1, and the
+name of a replacement type ("unknown" if it isn't one) */
+int cachesim_replacement_from_letter(char);
+
+const char* cachesim_replacement_name(ReplacementType);
+
+/*
+Binary trace format, all integers little-endian:
+
+header, BINARY_TRACE_HEADER_SIZE bytes:
+	magic "CSBT", u32 version, u32 records per block, u32 reserved,
+	u64 total records, u64 total blocks (both 0 if the writer couldn't seek)
+then blocks, each:
+	u32 records in this block, u32 bytes that follow
+	2 bits of AccessType per record, four to a byte, low bits first
+	one varint per record: the zigzag delta from the previous address of the
+	same stream (instruction or data), 7 bits a byte, low bits first
+
+The previous addresses start at 0 in every block, so blocks decode on their own.
+*/
+#define BINARY_TRACE_MAGIC "CSBT"
+#define BINARY_TRACE_VERSION 1
+#define BINARY_TRACE_HEADER_SIZE 32
+#define BINARY_TRACE_RECORDS 4096
+#define BINARY_TRACE_MAX_RECORDS (1 << 20)
+#define BINARY_TRACE_MAX_BLOCK(records) ((records) / 4 + 1 + (size_t)(records) * 10)
+
 #endif
@@ -0,0 +1,2201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "cache.h"
+
+/*
+libcachesim: the simulation engine behind the cachesim command, as a library.
+The interface is at the bottom of cachesim.h; cache.h has the structures it
+works on. Nothing in here is global, so any number of simulators can run in
+one process, on as many threads as there are handles.
+*/
+
+static void select_probe(struct Cache* cache, const char* kind);
+static access_fn select_access(const struct Cache* cache);
+static void prefetcher_setup(struct Cache* cache, const PrefetchInfo* info, int latency);
+static void prefetcher_clear(struct Prefetcher* pf);
+static void write_buffer_setup(struct WriteBuffer* wbuf, int entries, int word_bits, int address_bits);
+static struct SeenBlocks* seen_create(void);
+static void seen_clear(struct SeenBlocks* seen);
+static void seen_destroy(struct SeenBlocks* seen);
+static void shadow_clear(struct Shadow* shadow);
+
+static int is_power_of_two(int n) {
+	return n > 0 && (n & (n - 1)) == 0;
+}
+
+/* sizes of a cache's arrays in bytes, in the order they're laid out. Each
+starts on its own host cache line; the optional ones are 0 when the cache
+doesn't have them */
+struct Layout
+{
+	size_t tags;
+	size_t masks;	/* each of valid and dirty */
+	size_t repl;
+	size_t prefetched;
+	size_t issued_at;
+	size_t victim;
+	size_t buffer;
+	size_t sets;
+	size_t top;	/* each of the top-block arrays */
+	size_t top_index;
+	size_t shadow;	/* the shadow cache's blocks */
+	size_t shadow_links;	/* each of next and prev */
+	size_t shadow_index;
+};
+
+static size_t line_round(size_t bytes) {
+	return (bytes + 63) & ~(size_t)63;
+}
+
+static void cache_layout(const struct Cache* cache, struct Layout* layout) {
+	size_t num_blocks = (size_t)cache->num_sets * cache->ways;
+	int prefetcher = cache->pf.info.type != Prefetch_NONE;
+
+	layout->tags = line_round(num_blocks * (cache->wide ? sizeof(wide_tag_t) : sizeof(tag_t)));
+	layout->masks = line_round((size_t)cache->num_sets * cache->mask_words * sizeof(uint64_t));
+	layout->repl = line_round((size_t)cache->num_sets * cache->repl_stride);
+	layout->prefetched = prefetcher ? layout->masks : 0;
+	layout->issued_at = prefetcher ? line_round(num_blocks * sizeof(uint32_t)) : 0;
+	layout->victim = line_round((size_t)cache->victim.size * sizeof(struct VictimBlock));
+	layout->buffer = line_round((size_t)cache->wbuf.size * sizeof(struct BufferEntry));
+	layout->sets = cache->inst.per_set ? line_round((size_t)cache->num_sets * sizeof(struct SetStats)) : 0;
+	layout->top = line_round((size_t)cache->inst.top * sizeof(uint64_t));
+	layout->top_index = line_round(cache->inst.index_size * sizeof(int32_t));
+	layout->shadow = line_round((size_t)cache->shadow.size * sizeof(memaddr_t));
+	layout->shadow_links = cache->shadow.size ? line_round(((size_t)cache->shadow.size + 1) * sizeof(int32_t)) : 0;
+	layout->shadow_index = line_round(cache->shadow.index_size * sizeof(int32_t));
+}
+
+/* configures one cache level. Everything the simulator keeps per block goes in
+one 64-byte-aligned block of storage_size bytes, as parallel arrays indexed
+set * ways + way, so probing a set only touches that set's packed tags and its
+valid mask; cache_place hands it its storage. data_cache says which of
+options' prefetchers to use, and gives it the victim cache and write buffer.
+Returns NULL, or what is wrong with info (or that the block set of 3C
+classification, the one thing allocated here, didn't fit) */
+const char* cache_setup(struct Cache* cache, const CacheInfo* info, const struct cachesim_options* options,
+	int data_cache) {
+	const PrefetchInfo* prefetch = data_cache ? &options->dcache_prefetch : &options->icache_prefetch;
+	int address_bits = options->address_bits ? options->address_bits : 32;
+	int word_bits, tag_bits, row_bits;
+	struct Layout layout;
+
+	memset(cache, 0, sizeof(*cache));
+	if( info->num_blocks == 0 ) {	// this cache is disabled
+		cache->access = select_access(cache);
+		return NULL;
+	}
+
+	if( !is_power_of_two(info->num_blocks) || !is_power_of_two(info->words_per_block) ||
+		!is_power_of_two(info->associativity) || info->associativity > info->num_blocks ) {
+		return "Cache blocks, words per block, and associativity must be powers of two.";
+	}
+	if( prefetch->type < Prefetch_NONE || prefetch->type > Prefetch_STREAM ||
+		prefetch->degree < 0 || prefetch->distance < 0 || options->prefetch_latency < 0 ) {
+		return "Invalid prefetcher.";
+	}
+	if( info->replacement < Replacement_LRU || info->replacement > Replacement_BIT_PLRU ) {
+		return "Invalid replacement policy.";
+	}
+	if( options->victim_blocks < 0 || options->victim_blocks > VICTIM_MAX_BLOCKS ) {
+		return "The victim cache can have at most 1024 blocks.";
+	}
+	if( options->write_buffer_entries < 0 || options->write_buffer_entries > WRITE_BUFFER_MAX_ENTRIES ) {
+		return "The write buffer can have at most 1024 entries.";
+	}
+	if( options->top_blocks < 0 || options->top_blocks > TOP_BLOCKS_MAX ) {
+		return "At most 1024 most-missing blocks can be tracked.";
+	}
+	if( options->sample_sets < 0 || (options->sample_sets > 1 && !is_power_of_two(options->sample_sets)) ) {
+		return "Set sampling takes a power of two.";
+	}
+
+	cache->ways = info->associativity;
+	cache->num_sets = info->num_blocks / info->associativity;
+	cache->words_per_block = info->words_per_block;
+	cache->mask_words = (cache->ways + 63) / 64;
+	cache->replacement = info->replacement;
+	cache->write_scheme = info->write_scheme;
+	cache->allocate_scheme = info->allocate_scheme;
+	if( cache->ways > 1 ) {
+		cache->policy = replacement_policy(info->replacement);
+		cache->repl_stride = (cache->policy->set_bytes(cache->ways) + 7) & ~(size_t)7;
+	}
+
+	bit_extractor_calculator(&word_bits, &tag_bits, &row_bits, info->words_per_block, cache->num_sets, address_bits);
+	if( tag_bits < 0 ) {
+		return "The cache is bigger than the address space.";
+	}
+	decoder_setup(&cache->decoder, word_bits, row_bits, tag_bits);
+	cache->wide = tag_bits > 32;
+	prefetcher_setup(cache, prefetch, options->prefetch_latency);
+	if( data_cache ) {
+		cache->victim.size = options->victim_blocks;
+		write_buffer_setup(&cache->wbuf, options->write_buffer_entries, word_bits, address_bits);
+	}
+	if( options->sample_sets > 1 ) {	// at least one set, scattered over the cache
+		cache->sample_limit = cache->num_sets > options->sample_sets ? cache->num_sets / options->sample_sets : 1;
+	}
+	cache->inst.per_set = options->instrument || cache->sample_limit != 0;	// sampling's interval needs them
+	cache->inst.top = options->top_blocks;
+	for( cache->inst.index_size = cache->inst.top ? 1 : 0; cache->inst.index_size < 2 * (size_t)cache->inst.top; ) {
+		cache->inst.index_size *= 2;
+	}
+	if( options->classify_misses ) {
+		// as big as the sets it sees
+		cache->shadow.size = cache->sample_limit ? cache->sample_limit * cache->ways : info->num_blocks;
+		for( cache->shadow.index_size = 1; cache->shadow.index_size < 2 * (size_t)cache->shadow.size; ) {
+			cache->shadow.index_size *= 2;
+		}
+		cache->shadow.seen = seen_create();
+		if( cache->shadow.seen == NULL ) {
+			return "Out of memory allocating the cache.";
+		}
+	}
+	select_probe(cache, options->simd);
+	cache->access = select_access(cache);
+
+	cache_layout(cache, &layout);
+	cache->storage_size = layout.tags + 2 * layout.masks + layout.repl + layout.prefetched + layout.issued_at +
+		layout.victim + layout.buffer + layout.sets + 5 * layout.top + layout.top_index +
+		layout.shadow + 2 * layout.shadow_links + layout.shadow_index;
+	return NULL;
+}
+
+static void init_replacement(struct Cache* cache) {
+	for( int row = 0; row < cache->num_sets && cache->policy != NULL; row++ ) {
+		cache->policy->init(cache->repl_state + (size_t)row * cache->repl_stride, cache->ways);
+	}
+}
+
+/* points a set-up cache's arrays into storage, whatever is in it */
+static void cache_point(struct Cache* cache, void* storage) {
+	struct Layout layout;
+	char* next = storage;
+
+	cache_layout(cache, &layout);
+	cache->storage = storage;
+	cache->tags = (tag_t*)next;	// or wide_tags, the same bytes
+	cache->valid = (uint64_t*)(next += layout.tags);
+	cache->dirty = (uint64_t*)(next += layout.masks);
+	cache->repl_state = (unsigned char*)(next += layout.masks);
+	cache->pf.prefetched = layout.prefetched ? (uint64_t*)(next + layout.repl) : NULL;
+	cache->pf.issued_at = (uint32_t*)(next += layout.repl + layout.prefetched);
+	cache->victim.blocks = (struct VictimBlock*)(next += layout.issued_at);
+	cache->wbuf.entries = (struct BufferEntry*)(next += layout.victim);
+	cache->inst.sets = layout.sets ? (struct SetStats*)(next + layout.buffer) : NULL;
+	cache->inst.top_blocks = (memaddr_t*)(next += layout.buffer + layout.sets);
+	cache->inst.top_misses = (uint64_t*)(next += layout.top);
+	cache->inst.top_errors = (uint64_t*)(next += layout.top);
+	cache->inst.top_heap = (int32_t*)(next += layout.top);
+	cache->inst.top_position = (int32_t*)(next += layout.top);
+	cache->inst.top_index = (int32_t*)(next += layout.top);
+	cache->shadow.blocks = (memaddr_t*)(next += layout.top_index);
+	cache->shadow.next = (int32_t*)(next += layout.shadow);
+	cache->shadow.prev = (int32_t*)(next += layout.shadow_links);
+	cache->shadow.index = (int32_t*)(next += layout.shadow_links);
+}
+
+/* points a set-up cache's arrays into storage, which must be 64-byte aligned,
+storage_size bytes and zeroed */
+void cache_place(struct Cache* cache, void* storage) {
+	if( cache->storage_size == 0 ) {	// disabled
+		return;
+	}
+	cache_point(cache, storage);
+	init_replacement(cache);
+	shadow_clear(&cache->shadow);
+}
+
+/* empties the cache and zeroes its counters */
+void cache_clear(struct Cache* cache) {
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	memset(&cache->windows, 0, sizeof(cache->windows));
+	if( cache->storage == NULL ) {
+		return;
+	}
+	memset(cache->storage, 0, cache->storage_size);
+	init_replacement(cache);
+	prefetcher_clear(&cache->pf);
+	cache->victim.clock = 0;
+	cache->wbuf.next = 0;
+	cache->inst.top_used = 0;
+	shadow_clear(&cache->shadow);
+	seen_clear(cache->shadow.seen);
+}
+
+/* zeroes a cache's counters, per-set counters and sketch, but leaves what it
+holds (and which blocks it has seen) alone */
+static void cache_clear_stats(struct Cache* cache) {
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	memset(&cache->windows, 0, sizeof(cache->windows));
+	if( cache->inst.sets != NULL ) {
+		memset(cache->inst.sets, 0, (size_t)cache->num_sets * sizeof(struct SetStats));
+	}
+	if( cache->inst.top != 0 ) {
+		memset(cache->inst.top_index, 0, cache->inst.index_size * sizeof(int32_t));
+		cache->inst.top_used = 0;
+	}
+}
+
+/*
+Arenas. All of a handle's metadata, both caches' arrays, is one anonymous
+mapping, so a handle costs one mmap and one munmap however big it is, and
+dozens of big ones in a sweep don't fragment the heap. Arenas of a huge page
+or more are backed by huge pages where the system has them, to save the TLB
+misses a big cache's random set accesses would take: first explicitly
+(MAP_HUGETLB, which needs pages reserved in /proc/sys/vm/nr_hugepages), then
+by asking for transparent huge pages. Mappings come back zeroed.
+*/
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static void* arena_map(size_t size, int huge_pages, size_t* mapped, const char** backing) {
+	void* arena;
+
+#ifdef MAP_HUGETLB
+	if( huge_pages && size >= HUGE_PAGE_SIZE ) {
+		*mapped = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		arena = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if( arena != MAP_FAILED ) {
+			*backing = "huge pages";
+			return arena;
+		}
+	}
+#endif
+	*mapped = size;
+	arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( arena == MAP_FAILED ) {
+		return NULL;
+	}
+	*backing = "normal pages";
+#ifdef MADV_HUGEPAGE
+	if( huge_pages && size >= HUGE_PAGE_SIZE && madvise(arena, size, MADV_HUGEPAGE) == 0 ) {
+		*backing = "transparent huge pages";
+	}
+#endif
+	return arena;
+}
+
+/* calculates size of the of all the bits for row, word, and tag */
+void bit_extractor_calculator(int* word_bits, int* tag_bits, int* row_bits, int words_per_block, int num_sets, int address_size) {
+
+	*row_bits = (int)ceil(log(num_sets)/log(2));	/* calculates how many bits are needed to find each set */
+
+	*word_bits = (int)ceil(log(words_per_block)/log(2));	/* number of bits needed for word indexing */
+
+	*tag_bits = address_size - *row_bits - *word_bits - 2;
+}
+
+/* precomputes the shifts and masks that pull the word, row, and tag fields
+out of an address, so decoding an access is a few shifts and ands */
+void decoder_setup(struct Decoder* decoder, int word_bits, int row_bits, int tag_bits) {
+	decoder->word_shift = 2;	/* skip the byte select bits */
+	decoder->word_mask = ((memaddr_t)1 << word_bits) - 1;
+	decoder->row_shift = decoder->word_shift + word_bits;
+	decoder->row_mask = ((memaddr_t)1 << row_bits) - 1;
+	decoder->tag_shift = decoder->row_shift + row_bits;
+	decoder->tag_mask = ((memaddr_t)1 << tag_bits) - 1;
+}
+
+/* splits an address into its tag and row (set) index */
+static inline void decode_address(const struct Decoder* decoder, memaddr_t address, memaddr_t* tag, int* row_index) {
+	*row_index = (int)((address >> decoder->row_shift) & decoder->row_mask);
+	*tag = (address >> decoder->tag_shift) & decoder->tag_mask;
+}
+
+/* the block an address is in, counted from 0, put back together from its row and tag */
+static inline memaddr_t block_number(const struct Cache* cache, int row_index, memaddr_t tag) {
+	return (tag << (cache->decoder.tag_shift - cache->decoder.row_shift)) | (memaddr_t)row_index;
+}
+
+/* whether a set is in a set-sampled cache's sample. Multiplying by an odd
+number permutes the set indexes, so exactly sample_limit sets pass, spread
+over the cache rather than every so many */
+#define SET_SCRAMBLE 0x9E3779B1u
+
+static inline int set_sampled(const struct Cache* cache, int row_index) {
+	return (int)(((memaddr_t)row_index * SET_SCRAMBLE) & cache->decoder.row_mask) < cache->sample_limit;
+}
+
+/* a slot in a table of entries (a power of two) for key */
+static inline size_t table_slot(memaddr_t key, size_t entries) {
+	return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) & (entries - 1);
+}
+
+static inline int block_is_set(const uint64_t* mask, int way) {
+	return (mask[way >> 6] >> (way & 63)) & 1;
+}
+
+/*
+Set probe kernels. Each one looks for tag among the ways of one set and
+returns the matching valid way or -1. The vector kernels compare 4 (SSE2),
+8 (AVX2) or 16 (AVX-512) packed tags per instruction; ways are a power of two,
+so a kernel is only used when the set is at least as wide as its vector.
+Caches with more than 32 tag bits store 64-bit tags and have their own kernels,
+4 (AVX2) or 8 (AVX-512) tags a compare. select_probe picks one per cache at
+setup, based on what the host CPU runs.
+*/
+static int probe_scalar(const tag_t* tags, const uint64_t* valid, int ways, tag_t tag) {
+	for( int way = 0; way < ways; way++ ) {
+		if( tags[way] == tag && block_is_set(valid, way) ) {
+			return way;
+		}
+	}
+	return -1;
+}
+
+static int probe_scalar_wide(const wide_tag_t* tags, const uint64_t* valid, int ways, wide_tag_t tag) {
+	for( int way = 0; way < ways; way++ ) {
+		if( tags[way] == tag && block_is_set(valid, way) ) {
+			return way;
+		}
+	}
+	return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* valid bits of ways [way, way + width), width <= 32 */
+static inline uint32_t valid_bits(const uint64_t* valid, int way, int width) {
+	uint64_t bits = valid[way >> 6] >> (way & 63);
+	return (uint32_t)(width == 32 ? bits : bits & (((uint64_t)1 << width) - 1));
+}
+
+__attribute__((target("sse2")))
+static int probe_sse2(const tag_t* tags, const uint64_t* valid, int ways, tag_t tag) {
+	__m128i key = _mm_set1_epi32((int)tag);
+	for( int way = 0; way < ways; way += 4 ) {
+		__m128i lanes = _mm_loadu_si128((const __m128i*)&tags[way]);
+		uint32_t hits = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lanes, key)));
+		hits &= valid_bits(valid, way, 4);
+		if( hits ) {
+			return way + __builtin_ctz(hits);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx2")))
+static int probe_avx2(const tag_t* tags, const uint64_t* valid, int ways, tag_t tag) {
+	__m256i key = _mm256_set1_epi32((int)tag);
+	for( int way = 0; way < ways; way += 8 ) {
+		__m256i lanes = _mm256_loadu_si256((const __m256i*)&tags[way]);
+		uint32_t hits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lanes, key)));
+		hits &= valid_bits(valid, way, 8);
+		if( hits ) {
+			return way + __builtin_ctz(hits);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx512f")))
+static int probe_avx512(const tag_t* tags, const uint64_t* valid, int ways, tag_t tag) {
+	__m512i key = _mm512_set1_epi32((int)tag);
+	for( int way = 0; way < ways; way += 16 ) {
+		__m512i lanes = _mm512_loadu_si512((const void*)&tags[way]);
+		uint32_t hits = _mm512_cmpeq_epi32_mask(lanes, key) & valid_bits(valid, way, 16);
+		if( hits ) {
+			return way + __builtin_ctz(hits);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx2")))
+static int probe_avx2_wide(const wide_tag_t* tags, const uint64_t* valid, int ways, wide_tag_t tag) {
+	__m256i key = _mm256_set1_epi64x((long long)tag);
+	for( int way = 0; way < ways; way += 4 ) {
+		__m256i lanes = _mm256_loadu_si256((const __m256i*)&tags[way]);
+		uint32_t hits = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(lanes, key)));
+		hits &= valid_bits(valid, way, 4);
+		if( hits ) {
+			return way + __builtin_ctz(hits);
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx512f")))
+static int probe_avx512_wide(const wide_tag_t* tags, const uint64_t* valid, int ways, wide_tag_t tag) {
+	__m512i key = _mm512_set1_epi64((long long)tag);
+	for( int way = 0; way < ways; way += 8 ) {
+		__m512i lanes = _mm512_loadu_si512((const void*)&tags[way]);
+		uint32_t hits = _mm512_cmpeq_epi64_mask(lanes, key) & valid_bits(valid, way, 8);
+		if( hits ) {
+			return way + __builtin_ctz(hits);
+		}
+	}
+	return -1;
+}
+#endif
+
+/* the widest probe kernel the CPU has that fits in a set of this many ways.
+kind forces one ("scalar", "sse2", "avx2" or "avx512"), NULL or "auto" doesn't */
+static probe_fn select_narrow_probe(int ways, const char* kind) {
+	int forced = kind != NULL && strcmp(kind, "auto") != 0;
+
+	if( !forced && ways < 4 ) {
+		return probe_scalar;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( ways >= 16 && __builtin_cpu_supports("avx512f") &&
+		(!forced || strcmp(kind, "avx512") == 0) ) {
+		return probe_avx512;
+	}
+	if( ways >= 8 && __builtin_cpu_supports("avx2") &&
+		(!forced || strcmp(kind, "avx2") == 0) ) {
+		return probe_avx2;
+	}
+	if( ways >= 4 && __builtin_cpu_supports("sse2") &&
+		(!forced || strcmp(kind, "sse2") == 0) ) {
+		return probe_sse2;
+	}
+#endif
+	return probe_scalar;
+}
+
+/* the same for 64-bit tags, which have no SSE2 kernel */
+static wide_probe_fn select_wide_probe(int ways, const char* kind) {
+	int forced = kind != NULL && strcmp(kind, "auto") != 0;
+
+	if( !forced && ways < 4 ) {
+		return probe_scalar_wide;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( ways >= 8 && __builtin_cpu_supports("avx512f") &&
+		(!forced || strcmp(kind, "avx512") == 0) ) {
+		return probe_avx512_wide;
+	}
+	if( ways >= 4 && __builtin_cpu_supports("avx2") &&
+		(!forced || strcmp(kind, "avx2") == 0) ) {
+		return probe_avx2_wide;
+	}
+#endif
+	return probe_scalar_wide;
+}
+
+static void select_probe(struct Cache* cache, const char* kind) {
+	if( cache->wide ) {
+		cache->wide_probe = select_wide_probe(cache->ways, kind);
+	} else {
+		cache->probe = select_narrow_probe(cache->ways, kind);
+	}
+}
+
+/* index of the first clear bit among the low nbits of a bitmask, or -1 */
+static int first_clear_bit(const uint64_t* bits, int nbits) {
+	for( int i = 0; i * 64 < nbits; i++ ) {
+		uint64_t clear = ~bits[i];
+		int left = nbits - i * 64;
+		if( left < 64 ) {
+			clear &= ((uint64_t)1 << left) - 1;
+		}
+		if( clear != 0 ) {
+			return i * 64 + __builtin_ctzll(clear);
+		}
+	}
+	return -1;
+}
+
+/* returns the first empty way in a set, or -1 if every way is valid */
+static int find_empty_way(const struct Cache* cache, int row_index) {
+	return first_clear_bit(&cache->valid[(size_t)row_index * cache->mask_words], cache->ways);
+}
+
+/*
+Replacement policies. Every policy only sees the state of one set:
+
+LRU keeps the ways in a doubly linked list in recency order, with a sentinel
+node at index ways. The links are uint16_t when they fit, and uint32_t in
+bigger sets. A touch moves the way to the front and the victim is the back,
+both O(1).
+
+Tree pseudo-LRU keeps a binary tree of ways - 1 bits (heap order, node 1 is the
+root). Each bit points to the half that was used less recently; a touch points
+the nodes on the way's path away from it and the victim is found by following
+them down, O(log ways).
+
+NRU and bit pseudo-LRU keep one bit per way, set on a touch, and evict the
+first way whose bit is clear. They differ in when the bits are cleared: NRU
+clears them all when it finds no victim, bit-PLRU clears all but the touched
+way as soon as the last one is set.
+
+Random needs no state in the set, it draws from the cache's own generator.
+*/
+#define LRU_NARROW_WAYS 65535	/* up to this many, the links and the sentinel fit in 16 bits */
+
+/* lru_init_B, lru_touch_B and lru_victim_B with B-bit links */
+#define LRU_LINKS(bits) \
+static void lru_init_##bits(void* state, int ways) { \
+	uint##bits##_t* next = state; \
+	uint##bits##_t* prev = next + ways + 1; \
+	for( int node = 0; node <= ways; node++ ) {	/* 0 is the MRU way, ways - 1 the LRU */ \
+		next[node] = (uint##bits##_t)(node == ways ? 0 : node + 1); \
+		prev[node] = (uint##bits##_t)(node == 0 ? ways : node - 1); \
+	} \
+} \
+static void lru_touch_##bits(struct Cache* cache, void* state, int way) { \
+	uint##bits##_t* next = state; \
+	uint##bits##_t* prev = next + cache->ways + 1; \
+	int head = cache->ways; \
+	if( next[head] == way ) { \
+		return; \
+	} \
+	next[prev[way]] = next[way];	/* unlink */ \
+	prev[next[way]] = prev[way]; \
+	next[way] = next[head];	/* and push on the front */ \
+	prev[way] = (uint##bits##_t)head; \
+	prev[next[head]] = (uint##bits##_t)way; \
+	next[head] = (uint##bits##_t)way; \
+} \
+static int lru_victim_##bits(struct Cache* cache, void* state) { \
+	const uint##bits##_t* prev = (const uint##bits##_t*)state + cache->ways + 1; \
+	return (int)prev[cache->ways]; \
+}
+
+LRU_LINKS(16)
+LRU_LINKS(32)
+
+static size_t lru_set_bytes(int ways) {
+	return 2 * (size_t)(ways + 1) * (ways <= LRU_NARROW_WAYS ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
+static void lru_init(void* state, int ways) {
+	if( ways <= LRU_NARROW_WAYS ) {
+		lru_init_16(state, ways);
+	} else {
+		lru_init_32(state, ways);
+	}
+}
+
+static void lru_touch(struct Cache* cache, void* state, int way) {
+	if( cache->ways <= LRU_NARROW_WAYS ) {
+		lru_touch_16(cache, state, way);
+	} else {
+		lru_touch_32(cache, state, way);
+	}
+}
+
+static int lru_victim(struct Cache* cache, void* state) {
+	return cache->ways <= LRU_NARROW_WAYS ? lru_victim_16(cache, state) : lru_victim_32(cache, state);
+}
+
+/* one bit per way (tree-PLRU uses bits 1 .. ways - 1) */
+static size_t bits_set_bytes(int ways) {
+	return (size_t)((ways + 63) / 64) * sizeof(uint64_t);
+}
+
+static void bits_init(void* state, int ways) {
+	memset(state, 0, bits_set_bytes(ways));
+}
+
+static inline int get_bit(const uint64_t* bits, int i) {
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void put_bit(uint64_t* bits, int i, int value) {
+	uint64_t bit = (uint64_t)1 << (i & 63);
+	bits[i >> 6] = value ? bits[i >> 6] | bit : bits[i >> 6] & ~bit;
+}
+
+static void plru_touch(struct Cache* cache, void* state, int way) {
+	int node = 1;
+
+	for( int level = __builtin_ctz(cache->ways) - 1; level >= 0; level-- ) {
+		int right = (way >> level) & 1;
+		put_bit(state, node, !right);	// point at the other half
+		node = 2 * node + right;
+	}
+}
+
+static int plru_victim(struct Cache* cache, void* state) {
+	int node = 1;
+
+	while( node < cache->ways ) {
+		node = 2 * node + get_bit(state, node);
+	}
+	return node - cache->ways;
+}
+
+static void nru_touch(struct Cache* cache, void* state, int way) {
+	(void)cache;
+	put_bit(state, way, 1);
+}
+
+static int nru_victim(struct Cache* cache, void* state) {
+	int way = first_clear_bit(state, cache->ways);
+
+	if( way < 0 ) {	// everything was used recently, start a new round
+		bits_init(state, cache->ways);
+		way = 0;
+	}
+	return way;
+}
+
+static void bit_plru_touch(struct Cache* cache, void* state, int way) {
+	put_bit(state, way, 1);
+	if( first_clear_bit(state, cache->ways) < 0 ) {
+		bits_init(state, cache->ways);
+		put_bit(state, way, 1);
+	}
+}
+
+static int bit_plru_victim(struct Cache* cache, void* state) {
+	int way = first_clear_bit(state, cache->ways);
+	return way < 0 ? 0 : way;
+}
+
+static size_t no_set_bytes(int ways) {
+	(void)ways;
+	return 0;
+}
+
+static void no_init(void* state, int ways) {
+	(void)state;
+	(void)ways;
+}
+
+static void no_touch(struct Cache* cache, void* state, int way) {
+	(void)cache;
+	(void)state;
+	(void)way;
+}
+
+/* xoshiro256**, one generator per cache so configurations never share one */
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t random_next(uint64_t* s) {
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* uniform in [0, n), Lemire's multiply-shift with rejection so it is unbiased */
+static inline uint32_t random_below(uint64_t* s, uint32_t n) {
+	uint64_t m = (random_next(s) >> 32) * n;
+
+	if( (uint32_t)m < n ) {
+		uint32_t threshold = -n % n;
+		while( (uint32_t)m < threshold ) {
+			m = (random_next(s) >> 32) * n;
+		}
+	}
+	return (uint32_t)(m >> 32);
+}
+
+/* fills the generator from seed with splitmix64, as xoshiro's authors suggest */
+void cache_seed(struct Cache* cache, uint64_t seed) {
+	for( int i = 0; i < 4; i++ ) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cache->rng[i] = z ^ (z >> 31);
+	}
+}
+
+static int random_victim(struct Cache* cache, void* state) {
+	(void)state;
+	return (int)random_below(cache->rng, (uint32_t)cache->ways);
+}
+
+/* indexed by ReplacementType */
+static const struct ReplacementPolicy replacement_policies[] = {
+	{ 'L', "LRU", lru_set_bytes, lru_init, lru_touch, lru_victim },
+	{ 'R', "Random", no_set_bytes, no_init, no_touch, random_victim },
+	{ 'P', "tree PLRU", bits_set_bytes, bits_init, plru_touch, plru_victim },
+	{ 'N', "NRU", bits_set_bytes, bits_init, nru_touch, nru_victim },
+	{ 'B', "bit PLRU", bits_set_bytes, bits_init, bit_plru_touch, bit_plru_victim },
+};
+
+const struct ReplacementPolicy* replacement_policy(ReplacementType type) {
+	return &replacement_policies[type];
+}
+
+const char* cachesim_replacement_name(ReplacementType type) {
+	if( type < Replacement_LRU || type > Replacement_BIT_PLRU ) {
+		return "unknown";
+	}
+	return replacement_policies[type].name;
+}
+
+/* the policy a -I/-D replacement letter names, or -1 */
+int cachesim_replacement_from_letter(char letter) {
+	for( size_t i = 0; i < sizeof(replacement_policies) / sizeof(replacement_policies[0]); i++ ) {
+		if( replacement_policies[i].letter == letter ) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static inline void* repl_set(const struct Cache* cache, int row_index) {
+	return cache->repl_state + (size_t)row_index * cache->repl_stride;
+}
+
+/*
+Access kernels. Nothing about a cache's configuration changes after setup, so
+rather than test it on every access, cache_access takes it as compile-time
+constant arguments (64-bit tags or not, extras or not, direct-mapped or not,
+write-through, no-allocate and the replacement policy) and is expanded into one kernel per combination below.
+cache_setup picks the cache's kernel from access_kernels once; the only
+branches left in a kernel are on the access itself. Extras are the optional
+structures around a cache: a prefetcher, victim cache, write buffer,
+instrumentation, 3C classification or set sampling. Their hooks are only
+compiled into the kernels of caches that have some.
+*/
+#define KERNEL static inline __attribute__((always_inline))
+
+KERNEL void policy_touch(struct Cache* cache, int replacement, int row_index, int way) {
+	switch(replacement)
+	{
+		case Replacement_LRU: lru_touch(cache, repl_set(cache, row_index), way); break;
+		case Replacement_PLRU: plru_touch(cache, repl_set(cache, row_index), way); break;
+		case Replacement_NRU: nru_touch(cache, repl_set(cache, row_index), way); break;
+		case Replacement_BIT_PLRU: bit_plru_touch(cache, repl_set(cache, row_index), way); break;
+	}
+}
+
+/* picks which valid block of a full set gets kicked out */
+KERNEL int replace_block(struct Cache* cache, int replacement, int row_index) {
+	switch(replacement)
+	{
+		case Replacement_LRU: return lru_victim(cache, repl_set(cache, row_index));
+		case Replacement_RANDOM: return random_victim(cache, NULL);
+		case Replacement_PLRU: return plru_victim(cache, repl_set(cache, row_index));
+		case Replacement_NRU: return nru_victim(cache, repl_set(cache, row_index));
+		case Replacement_BIT_PLRU: return bit_plru_victim(cache, repl_set(cache, row_index));
+	}
+	return 0;
+}
+
+/* looks for tag in one set, returns the way holding it or -1 on a miss */
+KERNEL int cache_probe(const struct Cache* cache, int wide, int direct, int row_index, memaddr_t tag) {
+	const uint64_t* valid = &cache->valid[(size_t)row_index * cache->mask_words];
+	size_t block = (size_t)row_index * cache->ways;
+
+	if( direct ) {
+		int match = wide ? cache->wide_tags[row_index] == tag : cache->tags[row_index] == (tag_t)tag;
+		return (match && (cache->valid[row_index] & 1)) ? 0 : -1;
+	}
+	if( wide ) {
+		return cache->wide_probe(&cache->wide_tags[block], valid, cache->ways, tag);
+	}
+	return cache->probe(&cache->tags[block], valid, cache->ways, (tag_t)tag);
+}
+
+KERNEL int set_is_full(const struct Cache* cache, int direct, int row_index) {
+	return direct ? (int)(cache->valid[row_index] & 1) : find_empty_way(cache, row_index) < 0;
+}
+
+/*
+Instrumentation. An instrumented cache counts accesses per set, which is the
+one extra increment every access pays; misses and evictions per set are only
+counted on misses. The blocks that miss most, when asked for, are found with a
+space-saving sketch of top entries: a block already in it counts up, a new one takes the
+place of the entry with the fewest misses and inherits its count, which is
+recorded as its error. Any block that missed more than 1 / top of the time is
+guaranteed to be in it. Entries are found by block through a linearly probed
+hash table, and the one with the fewest misses is the root of a min-heap of
+entry numbers, so a miss costs O(log top).
+*/
+
+/* Block indexes: linearly probed hash tables of size slots (a power of two)
+from a block to the number + 1 of the entry holding it in blocks, 0 if the
+slot is free. The most-missing block sketch and the shadow cache of 3C
+classification find their entries with one */
+
+/* the slot holding block, or the free slot where it would go */
+static size_t index_slot(const int32_t* index, size_t size, const memaddr_t* blocks, memaddr_t block) {
+	size_t mask = size - 1;
+	size_t slot = table_slot(block, size);
+
+	while( index[slot] != 0 && blocks[index[slot] - 1] != block ) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/* takes block out of the index, moving back the entries after it that would
+no longer be found */
+static void index_remove(int32_t* index, size_t size, const memaddr_t* blocks, memaddr_t block) {
+	size_t mask = size - 1;
+	size_t hole = index_slot(index, size, blocks, block);
+
+	index[hole] = 0;
+	for( size_t slot = (hole + 1) & mask; index[slot] != 0; slot = (slot + 1) & mask ) {
+		size_t home = table_slot(blocks[index[slot] - 1], size);
+		if( ((slot - home) & mask) >= ((slot - hole) & mask) ) {
+			index[hole] = index[slot];
+			index[slot] = 0;
+			hole = slot;
+		}
+	}
+}
+
+/* restores the heap below position i, whose entry's count went up */
+static void top_sift_down(struct Instrumentation* inst, int i) {
+	int32_t entry = inst->top_heap[i];
+	uint64_t misses = inst->top_misses[entry];
+
+	for( ;; ) {
+		int child = 2 * i + 1;
+		if( child >= inst->top_used ) {
+			break;
+		}
+		if( child + 1 < inst->top_used &&
+			inst->top_misses[inst->top_heap[child + 1]] < inst->top_misses[inst->top_heap[child]] ) {
+			child++;
+		}
+		if( misses <= inst->top_misses[inst->top_heap[child]] ) {
+			break;
+		}
+		inst->top_heap[i] = inst->top_heap[child];
+		inst->top_position[inst->top_heap[i]] = i;
+		i = child;
+	}
+	inst->top_heap[i] = entry;
+	inst->top_position[entry] = i;
+}
+
+static void count_miss(struct Cache* cache, int row_index, memaddr_t tag) {
+	struct Instrumentation* inst = &cache->inst;
+	memaddr_t block = block_number(cache, row_index, tag);
+	size_t slot;
+	int32_t entry;
+
+	if( inst->sets != NULL ) {
+		inst->sets[row_index].misses++;
+	}
+	if( inst->top == 0 ) {
+		return;
+	}
+	slot = index_slot(inst->top_index, inst->index_size, inst->top_blocks, block);
+	if( inst->top_index[slot] != 0 ) {
+		entry = inst->top_index[slot] - 1;
+		inst->top_misses[entry]++;
+		top_sift_down(inst, inst->top_position[entry]);
+		return;
+	}
+	if( inst->top_used < inst->top ) {
+		// 1 miss is as few as any entry has, so it can go last and still be a heap
+		entry = inst->top_used++;
+		inst->top_heap[entry] = entry;
+		inst->top_position[entry] = entry;
+		inst->top_blocks[entry] = block;
+		inst->top_misses[entry] = 1;
+		inst->top_errors[entry] = 0;
+		inst->top_index[slot] = entry + 1;
+		return;
+	}
+	entry = inst->top_heap[0];	// the fewest misses
+	index_remove(inst->top_index, inst->index_size, inst->top_blocks, inst->top_blocks[entry]);
+	inst->top_blocks[entry] = block;
+	inst->top_errors[entry] = inst->top_misses[entry];
+	inst->top_misses[entry]++;
+	inst->top_index[index_slot(inst->top_index, inst->index_size, inst->top_blocks, block)] = entry + 1;
+	top_sift_down(inst, 0);
+}
+
+/*
+Miss classification (3C). A miss is compulsory if the block has never been
+brought into the cache before, which the cache's SeenBlocks set keeps track of;
+it is only looked at on misses, and with a bit per block in groups of 64 it
+stays small enough to mostly sit in the host's caches. Otherwise it is a capacity miss if the shadow
+cache, a fully-associative LRU cache of the same number of blocks that sees
+every access, missed too, and a conflict miss if only the real cache did. The
+shadow finds blocks through a block index and keeps them in a linked list in
+recency order, so it costs O(1) per access, about what the real cache's own
+set probe does. Both follow the cache's allocation: a store that writes around
+the cache doesn't bring its block into either.
+*/
+#define SEEN_MIN_GROUPS 1024
+
+static struct SeenBlocks* seen_create(void) {
+	struct SeenBlocks* seen = malloc(sizeof(struct SeenBlocks));
+
+	if( seen == NULL ) {
+		return NULL;
+	}
+	seen->size = SEEN_MIN_GROUPS;
+	seen->used = 0;
+	seen->groups = calloc(seen->size, sizeof(struct SeenGroup));
+	if( seen->groups == NULL ) {
+		free(seen);
+		return NULL;
+	}
+	return seen;
+}
+
+static void seen_clear(struct SeenBlocks* seen) {
+	if( seen != NULL ) {
+		memset(seen->groups, 0, seen->size * sizeof(struct SeenGroup));
+		seen->used = 0;
+	}
+}
+
+static void seen_destroy(struct SeenBlocks* seen) {
+	if( seen != NULL ) {
+		free(seen->groups);
+		free(seen);
+	}
+}
+
+/* the entry of group (block / 64 + 1), or the free one where it would go */
+static struct SeenGroup* seen_group(const struct SeenBlocks* seen, memaddr_t group) {
+	size_t mask = seen->size - 1;
+	size_t slot = table_slot(group, seen->size);
+
+	while( seen->groups[slot].group != 0 && seen->groups[slot].group != group ) {
+		slot = (slot + 1) & mask;
+	}
+	return &seen->groups[slot];
+}
+
+/* doubles the table, or returns 0 if there's no memory for it */
+static int seen_grow(struct SeenBlocks* seen) {
+	struct SeenGroup* old = seen->groups;
+	size_t old_size = seen->size;
+
+	seen->groups = calloc(2 * old_size, sizeof(struct SeenGroup));
+	if( seen->groups == NULL ) {
+		seen->groups = old;
+		return 0;
+	}
+	seen->size = 2 * old_size;
+	for( size_t i = 0; i < old_size; i++ ) {
+		if( old[i].group != 0 ) {
+			*seen_group(seen, old[i].group) = old[i];
+		}
+	}
+	free(old);
+	return 1;
+}
+
+static int seen_contains(const struct SeenBlocks* seen, memaddr_t block) {
+	return (seen_group(seen, (block >> 6) + 1)->blocks >> (block & 63)) & 1;
+}
+
+/* adds block to the set, returns whether it is new. If the table is full and
+can't grow, blocks of new groups are no longer remembered */
+static int seen_insert(struct SeenBlocks* seen, memaddr_t block) {
+	memaddr_t group = (block >> 6) + 1;
+	uint64_t bit = (uint64_t)1 << (block & 63);
+	struct SeenGroup* entry = seen_group(seen, group);
+
+	if( entry->group == 0 ) {
+		if( 2 * (seen->used + 1) > seen->size && seen_grow(seen) ) {
+			entry = seen_group(seen, group);
+		}
+		if( seen->used + 1 == seen->size ) {	// a free entry has to be left for lookups to end on
+			return 1;
+		}
+		entry->group = group;
+		seen->used++;
+	}
+	if( entry->blocks & bit ) {
+		return 0;
+	}
+	entry->blocks |= bit;
+	return 1;
+}
+
+static void shadow_clear(struct Shadow* shadow) {
+	if( shadow->size != 0 ) {
+		shadow->used = 0;
+		shadow->next[shadow->size] = shadow->size;
+		shadow->prev[shadow->size] = shadow->size;
+		memset(shadow->index, 0, shadow->index_size * sizeof(int32_t));
+	}
+}
+
+/* accesses block in the shadow cache, bringing it in on a miss if allocate.
+Returns whether it hit */
+static int shadow_access(struct Shadow* shadow, memaddr_t block, int allocate) {
+	size_t slot = index_slot(shadow->index, shadow->index_size, shadow->blocks, block);
+	int head = shadow->size;
+	int hit = shadow->index[slot] != 0;
+	int entry;
+
+	if( hit ) {
+		entry = shadow->index[slot] - 1;
+		if( shadow->next[head] == entry ) {
+			return 1;
+		}
+		shadow->next[shadow->prev[entry]] = shadow->next[entry];	// unlink
+		shadow->prev[shadow->next[entry]] = shadow->prev[entry];
+	} else if( !allocate ) {
+		return 0;
+	} else if( shadow->used < shadow->size ) {
+		entry = shadow->used++;
+		shadow->blocks[entry] = block;
+		shadow->index[slot] = entry + 1;
+	} else {
+		entry = shadow->prev[head];	// the least recently used block makes way
+		shadow->next[shadow->prev[entry]] = head;
+		shadow->prev[head] = shadow->prev[entry];
+		index_remove(shadow->index, shadow->index_size, shadow->blocks, shadow->blocks[entry]);
+		shadow->blocks[entry] = block;
+		shadow->index[index_slot(shadow->index, shadow->index_size, shadow->blocks, block)] = entry + 1;
+	}
+	shadow->next[entry] = shadow->next[head];	// and push it on the front
+	shadow->prev[entry] = head;
+	shadow->prev[shadow->next[head]] = entry;
+	shadow->next[head] = entry;
+	return hit;
+}
+
+/* counts a miss, given whether the shadow cache hit and whether the cache
+brings the block in */
+static void classify_miss(struct Cache* cache, memaddr_t block, int shadow_hit, int allocate) {
+	int seen = allocate ? !seen_insert(cache->shadow.seen, block) : seen_contains(cache->shadow.seen, block);
+
+	if( !seen ) {
+		cache->stats.compulsory_miss++;
+	} else if( !shadow_hit ) {
+		cache->stats.capacity_miss++;
+	} else {
+		cache->stats.conflict_miss++;
+	}
+}
+
+/* counts a miss by whether it found an empty way in its set (full says it
+didn't), unless the cache classifies its misses properly */
+KERNEL void count_miss_kind(struct Cache* cache, int extras, int full) {
+	if( extras && cache->shadow.size != 0 ) {
+		return;
+	}
+	if( full ) {
+		cache->stats.conflict_miss++;
+	} else {
+		cache->stats.compulsory_miss++;
+	}
+}
+
+/*
+Victim caches and write buffers, for the L1 D-cache. With a victim cache, the
+blocks the cache kicks out go there instead of away (a dirty one is only
+written back once the victim cache drops it in turn), and a miss that finds its
+block there swaps it back in without going to memory. It is fully associative
+and drops the block it has held longest. A write buffer holds the words stores
+write through or around the cache, a block to an entry, until a new block needs
+its oldest entry; a store to a block it holds merges into that entry. A word is
+counted in words_written_to_mem when it first enters the buffer, which is what
+reaches memory once the buffer drains.
+*/
+static void write_buffer_setup(struct WriteBuffer* wbuf, int entries, int word_bits, int address_bits) {
+	int unit_bits = word_bits < 6 ? word_bits : 6;	/* a word mask is 64 bits */
+
+	wbuf->size = entries;
+	wbuf->unit_shift = 2 + unit_bits;
+	wbuf->unit_mask = ((memaddr_t)1 << (address_bits - wbuf->unit_shift)) - 1;
+	wbuf->word_mask = ((memaddr_t)1 << unit_bits) - 1;
+}
+
+static void buffer_store(struct Cache* cache, memaddr_t address) {
+	struct WriteBuffer* wbuf = &cache->wbuf;
+	memaddr_t unit = ((address >> wbuf->unit_shift) & wbuf->unit_mask) + 1;
+	uint64_t word = (uint64_t)1 << ((address >> 2) & wbuf->word_mask);
+	struct BufferEntry* entry;
+
+	for( int i = 0; i < wbuf->size; i++ ) {
+		entry = &wbuf->entries[i];
+		if( entry->unit == unit ) {
+			cache->stats.write_buffer_merges++;
+			if( !(entry->words & word) ) {
+				entry->words |= word;
+				cache->stats.words_written_to_mem++;
+			}
+			return;
+		}
+	}
+	entry = &wbuf->entries[wbuf->next];
+	wbuf->next = (wbuf->next + 1) % wbuf->size;
+	entry->unit = unit;
+	entry->words = word;
+	cache->stats.words_written_to_mem++;
+}
+
+/* the victim cache entry holding block, or -1 */
+static int victim_find(const struct Cache* cache, memaddr_t block) {
+	for( int i = 0; i < cache->victim.size; i++ ) {
+		if( cache->victim.blocks[i].age != 0 && cache->victim.blocks[i].block == block ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* takes block out of the victim cache if it's there, *dirty says whether it
+was dirty */
+static int victim_take(struct Cache* cache, memaddr_t block, int* dirty) {
+	int i = victim_find(cache, block);
+
+	if( i < 0 ) {
+		return 0;
+	}
+	*dirty = cache->victim.blocks[i].dirty;
+	cache->victim.blocks[i].age = 0;
+	cache->stats.victim_hits++;
+	return 1;
+}
+
+static void victim_put(struct Cache* cache, memaddr_t block, int dirty) {
+	struct VictimCache* victim = &cache->victim;
+	struct VictimBlock* slot = &victim->blocks[0];
+
+	for( int i = 0; i < victim->size && slot->age != 0; i++ ) {
+		if( victim->blocks[i].age == 0 || victim->clock - victim->blocks[i].age > victim->clock - slot->age ) {
+			slot = &victim->blocks[i];
+		}
+	}
+	if( slot->age != 0 && slot->dirty ) {	// write-back of the block it drops
+		cache->stats.words_written_to_mem += cache->words_per_block;
+	}
+	if( ++victim->clock == 0 ) {
+		victim->clock = 1;
+	}
+	slot->block = block;
+	slot->dirty = dirty;
+	slot->age = victim->clock;
+}
+
+/* a store's word going through or around the cache */
+KERNEL void write_word(struct Cache* cache, int extras, memaddr_t address) {
+	if( extras && cache->wbuf.size != 0 ) {
+		buffer_store(cache, address);
+	} else {
+		cache->stats.words_written_to_mem++;
+	}
+}
+
+/* kicks the valid block in way out: a dirty one is written back, unless it
+goes to the victim cache */
+KERNEL void evict_block(struct Cache* cache, int wide, int extras, int row_index, int way) {
+	size_t block = (size_t)row_index * cache->ways + way;
+	int dirty = block_is_set(&cache->dirty[(size_t)row_index * cache->mask_words], way);
+
+	if( extras && cache->inst.sets != NULL ) {
+		cache->inst.sets[row_index].evictions++;
+	}
+	if( extras && cache->victim.size != 0 ) {
+		victim_put(cache, block_number(cache, row_index, wide ? cache->wide_tags[block] : cache->tags[block]), dirty);
+	} else if( dirty ) {
+		cache->stats.words_written_to_mem += cache->words_per_block;
+	}
+}
+
+/* brings a block in on a miss, from memory or (from_memory 0) the victim
+cache, and counts the miss (see count_miss_kind) */
+KERNEL void add_block(struct Cache* cache, int wide, int extras, int direct, int replacement,
+	int row_index, memaddr_t tag, int dirty, int from_memory) {
+	size_t block = (size_t)row_index * cache->ways;
+	uint64_t* valid = &cache->valid[(size_t)row_index * cache->mask_words];
+	uint64_t* dirty_mask = &cache->dirty[(size_t)row_index * cache->mask_words];
+	int way = direct ? ((valid[0] & 1) ? -1 : 0) : find_empty_way(cache, row_index);
+	uint64_t bit;
+
+	if( way < 0 ) {
+		way = direct ? 0 : replace_block(cache, replacement, row_index);
+		count_miss_kind(cache, extras, 1);
+		evict_block(cache, wide, extras, row_index, way);
+	} else {
+		count_miss_kind(cache, extras, 0);
+	}
+
+	bit = (uint64_t)1 << (way & 63);
+	if( wide ) {
+		cache->wide_tags[block + way] = tag;
+	} else {
+		cache->tags[block + way] = (tag_t)tag;
+	}
+	valid[way >> 6] |= bit;
+	if( !direct ) {
+		policy_touch(cache, replacement, row_index, way);
+	}
+	if( dirty ) {
+		dirty_mask[way >> 6] |= bit;
+	} else {
+		dirty_mask[way >> 6] &= ~bit;
+	}
+	if( extras && cache->pf.prefetched != NULL ) {
+		cache->pf.prefetched[(size_t)row_index * cache->mask_words + (way >> 6)] &= ~bit;
+	}
+	if( from_memory ) {
+		cache->stats.mem_reads += cache->words_per_block;
+	}
+}
+
+/*
+Prefetchers. A cache's prefetcher watches its demand accesses and brings blocks
+in ahead of them with prefetch_block, which fills a block like a miss does but
+leaves the miss counters alone. The kernels of caches that have one call
+prefetch_hit on every hit and prefetch_miss after every miss. Its state is a few small fixed tables, so it
+costs a handful of compares per access on top of the fills it makes.
+
+Nothing else in the simulator keeps time, so a prefetcher counts accesses to
+its cache (pf.clock): a prefetched block first accessed less than
+latency accesses after it was issued is late.
+*/
+#define DEFAULT_PREFETCH_LATENCY 32
+#define REGION_BITS 12	/* the stride prefetcher's regions are 4 KB */
+#define STREAM_WINDOW 8	/* blocks from a stream's last one that still continue it */
+
+static void prefetcher_setup(struct Cache* cache, const PrefetchInfo* info, int latency) {
+	struct Prefetcher* pf = &cache->pf;
+
+	pf->info = *info;
+	if( pf->info.degree == 0 ) {
+		pf->info.degree = 1;
+	}
+	if( pf->info.distance == 0 ) {
+		pf->info.distance = 1;
+	}
+	pf->latency = latency ? latency : DEFAULT_PREFETCH_LATENCY;
+	pf->region_shift = cache->decoder.row_shift < REGION_BITS ? REGION_BITS - cache->decoder.row_shift : 0;
+}
+
+/* forgets everything but the configuration */
+static void prefetcher_clear(struct Prefetcher* pf) {
+	pf->clock = 0;
+	memset(pf->evicted, 0, sizeof(pf->evicted));
+	memset(pf->strides, 0, sizeof(pf->strides));
+	memset(pf->streams, 0, sizeof(pf->streams));
+	pf->next_stream = 0;
+}
+
+/* brings block in unless it's already there */
+static void prefetch_block(struct Cache* cache, memaddr_t block) {
+	struct Prefetcher* pf = &cache->pf;
+	int row_index = (int)(block & cache->decoder.row_mask);
+	memaddr_t tag = (block >> (cache->decoder.tag_shift - cache->decoder.row_shift)) & cache->decoder.tag_mask;
+	size_t index = (size_t)row_index * cache->ways;
+	size_t mask = (size_t)row_index * cache->mask_words;
+	int way;
+	uint64_t bit;
+
+	if( cache_probe(cache, cache->wide, cache->ways == 1, row_index, tag) >= 0 || victim_find(cache, block) >= 0 ) {
+		return;
+	}
+	way = find_empty_way(cache, row_index);
+	if( way < 0 ) {
+		memaddr_t victim;
+		way = (cache->policy != NULL) ? cache->policy->victim(cache, repl_set(cache, row_index)) : 0;
+		victim = block_number(cache, row_index, cache->wide ? cache->wide_tags[index + way] : cache->tags[index + way]);
+		pf->evicted[table_slot(victim, POLLUTION_ENTRIES)] = victim + 1;
+		evict_block(cache, cache->wide, 1, row_index, way);
+	}
+
+	bit = (uint64_t)1 << (way & 63);
+	if( cache->wide ) {
+		cache->wide_tags[index + way] = tag;
+	} else {
+		cache->tags[index + way] = (tag_t)tag;
+	}
+	cache->valid[mask + (way >> 6)] |= bit;
+	cache->dirty[mask + (way >> 6)] &= ~bit;
+	pf->prefetched[mask + (way >> 6)] |= bit;
+	pf->issued_at[index + way] = pf->clock;
+	if( cache->policy != NULL ) {
+		cache->policy->touch(cache, repl_set(cache, row_index), way);
+	}
+	cache->stats.mem_reads += cache->words_per_block;
+	cache->stats.prefetches++;
+}
+
+/* prefetches degree blocks, starting distance steps past block */
+static void prefetch_run(struct Cache* cache, memaddr_t block, int64_t step) {
+	const PrefetchInfo* info = &cache->pf.info;
+
+	for( int i = 0; i < info->degree; i++ ) {
+		prefetch_block(cache, block + (memaddr_t)(step * (info->distance + i)));
+	}
+}
+
+/* once a region has shown the same stride twice in a row, prefetches along it */
+static void stride_train(struct Cache* cache, memaddr_t block) {
+	memaddr_t region = block >> cache->pf.region_shift;
+	struct StrideEntry* entry = &cache->pf.strides[table_slot(region, STRIDE_ENTRIES)];
+	int64_t stride;
+
+	if( !entry->valid || entry->region != region ) {
+		entry->valid = 1;
+		entry->region = region;
+		entry->last_block = block;
+		entry->stride = 0;
+		entry->confidence = 0;
+		return;
+	}
+	stride = (int64_t)(block - entry->last_block);
+	if( stride == 0 ) {
+		return;
+	}
+	if( stride == entry->stride ) {
+		if( entry->confidence < 3 ) {
+			entry->confidence++;
+		}
+	} else {
+		entry->stride = stride;
+		entry->confidence = 0;
+	}
+	entry->last_block = block;
+	if( entry->confidence > 0 ) {
+		prefetch_run(cache, block, stride);
+	}
+}
+
+/* follows block's stream, or starts one in place of the oldest. A stream
+prefetches once it has gone two steps the same way */
+static void stream_train(struct Cache* cache, memaddr_t block) {
+	struct Prefetcher* pf = &cache->pf;
+	struct StreamTracker* stream;
+
+	for( int i = 0; i < STREAM_TRACKERS; i++ ) {
+		int64_t step = (int64_t)(block - pf->streams[i].last_block);
+		if( (uint64_t)(step + STREAM_WINDOW) <= 2 * STREAM_WINDOW && step != 0 && pf->streams[i].valid ) {
+			int direction = step > 0 ? 1 : -1;
+
+			stream = &pf->streams[i];
+			if( direction == stream->direction ) {
+				if( stream->confidence < 3 ) {
+					stream->confidence++;
+				}
+			} else {
+				stream->direction = direction;
+				stream->confidence = 1;
+			}
+			stream->last_block = block;
+			if( stream->confidence >= 2 ) {
+				prefetch_run(cache, block, stream->direction);
+			}
+			return;
+		}
+	}
+	stream = &pf->streams[pf->next_stream];
+	pf->next_stream = (pf->next_stream + 1) % STREAM_TRACKERS;
+	stream->last_block = block;
+	stream->direction = 0;
+	stream->confidence = 0;
+	stream->valid = 1;
+}
+
+/* trigger is a miss or the first access to a prefetched block; the stride
+prefetcher learns from the other accesses too */
+static void prefetch_train(struct Cache* cache, memaddr_t block, int trigger) {
+	switch(cache->pf.info.type)
+	{
+		case Prefetch_NEXT_LINE: if( trigger ) prefetch_run(cache, block, 1); break;
+		case Prefetch_STRIDE: stride_train(cache, block); break;
+		case Prefetch_STREAM: if( trigger ) stream_train(cache, block); break;
+		case Prefetch_NONE: break;
+	}
+}
+
+static void prefetch_hit(struct Cache* cache, int row_index, int way, memaddr_t tag) {
+	struct Prefetcher* pf = &cache->pf;
+	size_t word = (size_t)row_index * cache->mask_words + (way >> 6);
+	uint64_t bit = (uint64_t)1 << (way & 63);
+	int trigger = (pf->prefetched[word] & bit) != 0;
+
+	pf->clock++;
+	if( trigger ) {	// first use of a prefetched block
+		pf->prefetched[word] &= ~bit;
+		cache->stats.useful_prefetches++;
+		if( pf->clock - pf->issued_at[(size_t)row_index * cache->ways + way] < pf->latency ) {
+			cache->stats.late_prefetches++;
+		}
+	}
+	if( trigger || pf->info.type == Prefetch_STRIDE ) {
+		prefetch_train(cache, block_number(cache, row_index, tag), trigger);
+	}
+}
+
+static void prefetch_miss(struct Cache* cache, int row_index, memaddr_t tag) {
+	struct Prefetcher* pf = &cache->pf;
+	memaddr_t block = block_number(cache, row_index, tag);
+	size_t slot = table_slot(block, POLLUTION_ENTRIES);
+
+	pf->clock++;
+	if( pf->evicted[slot] == block + 1 ) {	// a prefetch kicked this block out
+		cache->stats.polluting_prefetches++;
+		pf->evicted[slot] = 0;
+	}
+	prefetch_train(cache, block, 1);
+}
+
+KERNEL void cache_access(struct Cache* cache, AccessType type, memaddr_t address,
+	int wide, int extras, int direct, int write_through, int no_allocate, int replacement) {
+	int row_index;
+	int way;
+	int dirty;
+	int shadow_hit = 0;
+	int allocate = type != Access_D_WRITE || !no_allocate;
+	memaddr_t tag;
+
+	decode_address(&cache->decoder, address, &tag, &row_index);
+	if( extras && cache->sample_limit != 0 && !set_sampled(cache, row_index) ) {
+		return;	// not simulated at all
+	}
+	way = cache_probe(cache, wide, direct, row_index, tag);
+	if( extras && cache->inst.sets != NULL ) {
+		cache->inst.sets[row_index].accesses++;
+	}
+	if( extras && cache->shadow.size != 0 ) {
+		shadow_hit = shadow_access(&cache->shadow, block_number(cache, row_index, tag), allocate);
+	}
+
+	if( type == Access_D_WRITE ) {
+		cache->stats.writes++;
+	} else {
+		cache->stats.reads++;
+	}
+
+	if( way >= 0 ) {	// hit
+		if( !direct ) {
+			policy_touch(cache, replacement, row_index, way);
+		}
+		if( type == Access_D_WRITE ) {
+			if( !write_through ) {
+				cache->dirty[(size_t)row_index * cache->mask_words + (way >> 6)] |= (uint64_t)1 << (way & 63);
+			} else {
+				write_word(cache, extras, address);
+			}
+		}
+		if( extras && cache->pf.info.type != Prefetch_NONE ) {
+			prefetch_hit(cache, row_index, way, tag);
+		}
+		return;
+	}
+
+	cache->stats.write_misses += (type == Access_D_WRITE);
+	if( extras && (cache->inst.sets != NULL || cache->inst.top != 0) ) {
+		count_miss(cache, row_index, tag);
+	}
+	if( extras && cache->shadow.size != 0 ) {
+		classify_miss(cache, block_number(cache, row_index, tag), shadow_hit, allocate);
+	}
+	if( extras && cache->victim.size != 0 && victim_take(cache, block_number(cache, row_index, tag), &dirty) ) {
+		if( type == Access_D_WRITE ) {
+			if( write_through ) {
+				write_word(cache, extras, address);
+			} else {
+				dirty = 1;
+			}
+		}
+		add_block(cache, wide, extras, direct, replacement, row_index, tag, dirty, 0);
+	} else if( type != Access_D_WRITE ) {
+		add_block(cache, wide, extras, direct, replacement, row_index, tag, 0, 1);
+	} else if( !no_allocate ) {
+		add_block(cache, wide, extras, direct, replacement, row_index, tag, !write_through, 1);
+		if( write_through ) {
+			write_word(cache, extras, address);
+		}
+	} else {	// write around the cache, the miss is still counted
+		count_miss_kind(cache, extras, set_is_full(cache, direct, row_index));
+		write_word(cache, extras, address);
+	}
+	if( extras && cache->pf.info.type != Prefetch_NONE ) {
+		prefetch_miss(cache, row_index, tag);
+	}
+}
+
+/* access_W_X_D_T_N_R: wide tags, extras, direct-mapped, write-through,
+no-allocate, replacement */
+#define ACCESS_KERNEL(w, x, d, t, n, r) \
+static void access_##w##_##x##_##d##_##t##_##n##_##r(struct Cache* cache, AccessType type, memaddr_t address) { \
+	cache_access(cache, type, address, w, x, d, t, n, r); \
+}
+#define ACCESS_KERNELS(w, x, t, n) \
+	ACCESS_KERNEL(w, x, 1, t, n, 0) \
+	ACCESS_KERNEL(w, x, 0, t, n, 0) ACCESS_KERNEL(w, x, 0, t, n, 1) ACCESS_KERNEL(w, x, 0, t, n, 2) \
+	ACCESS_KERNEL(w, x, 0, t, n, 3) ACCESS_KERNEL(w, x, 0, t, n, 4)
+#define ACCESS_KERNEL_SET(w, x) \
+	ACCESS_KERNELS(w, x, 0, 0) ACCESS_KERNELS(w, x, 0, 1) ACCESS_KERNELS(w, x, 1, 0) ACCESS_KERNELS(w, x, 1, 1)
+
+ACCESS_KERNEL_SET(0, 0)
+ACCESS_KERNEL_SET(0, 1)
+ACCESS_KERNEL_SET(1, 0)
+ACCESS_KERNEL_SET(1, 1)
+
+/* direct-mapped caches have no replacement choice, so all five share one */
+#define ACCESS_ROW(w, x, t, n) { \
+	{ access_##w##_##x##_0_##t##_##n##_0, access_##w##_##x##_0_##t##_##n##_1, access_##w##_##x##_0_##t##_##n##_2, \
+	  access_##w##_##x##_0_##t##_##n##_3, access_##w##_##x##_0_##t##_##n##_4 }, \
+	{ access_##w##_##x##_1_##t##_##n##_0, access_##w##_##x##_1_##t##_##n##_0, access_##w##_##x##_1_##t##_##n##_0, \
+	  access_##w##_##x##_1_##t##_##n##_0, access_##w##_##x##_1_##t##_##n##_0 } }
+#define ACCESS_TABLE(w, x) \
+	{ { ACCESS_ROW(w, x, 0, 0), ACCESS_ROW(w, x, 0, 1) }, \
+	  { ACCESS_ROW(w, x, 1, 0), ACCESS_ROW(w, x, 1, 1) } }
+
+/* [wide tags][extras][write_scheme][allocate_scheme][direct-mapped][replacement] */
+static const access_fn access_kernels[2][2][2][2][2][5] = {
+	{ ACCESS_TABLE(0, 0), ACCESS_TABLE(0, 1) },
+	{ ACCESS_TABLE(1, 0), ACCESS_TABLE(1, 1) },
+};
+
+/* what a disabled cache (num_blocks 0) does with its accesses */
+static void access_disabled(struct Cache* cache, AccessType type, memaddr_t address) {
+	(void)cache;
+	(void)type;
+	(void)address;
+}
+
+/* the kernel for a cache's configuration */
+static access_fn select_access(const struct Cache* cache) {
+	int direct = cache->ways == 1;
+	int extras = cache->pf.info.type != Prefetch_NONE || cache->victim.size != 0 || cache->wbuf.size != 0 ||
+		cache->inst.per_set || cache->inst.top != 0 || cache->shadow.size != 0 || cache->sample_limit != 0;
+
+	if( cache->num_sets == 0 ) {
+		return access_disabled;
+	}
+	return access_kernels[cache->wide][extras]
+		[cache->write_scheme][cache->allocate_scheme][direct][direct ? 0 : cache->replacement];
+}
+
+static inline struct Cache* cache_for(cachesim_t* sim, AccessType type) {
+	return (type == Access_I_FETCH) ? &sim->icache : &sim->dcache;
+}
+
+static void time_sampled_run(cachesim_t* sim, const struct Access* accesses, size_t n);
+
+void cachesim_access(cachesim_t* sim, AccessType type, memaddr_t address)
+{
+	struct Cache* cache = cache_for(sim, type);
+
+	/* This is where all the fun stuff happens! This function is called to
+	simulate a memory access. You figure out what type it is, and do all your
+	fun simulation stuff from here. */
+	if( sim->sample_period != 0 ) {
+		struct Access access = { address, type };
+		time_sampled_run(sim, &access, 1);
+		return;
+	}
+	cache->access(cache, type, address);
+}
+
+/*
+Batched accesses. A cache much bigger than the host's own caches misses in
+them on nearly every lookup, and cachesim_access would wait for each set's tags
+in turn. cachesim_access_batch decodes the set an access PREFETCH_DISTANCE ahead
+will use and prefetches its tags, valid mask and replacement state, so those
+loads are in flight while the accesses before it run. Accesses are still
+simulated one at a time in order, so the results are the same.
+*/
+#define PREFETCH_DISTANCE 16
+#define PREFETCH_MIN_BYTES (1 << 20)	/* smaller caches stay in the host's L2 anyway */
+
+static inline void prefetch_set(const struct Cache* cache, const struct Access* access) {
+	int row_index;
+	memaddr_t tag;
+
+	decode_address(&cache->decoder, access->address, &tag, &row_index);
+	if( cache->sample_limit != 0 && !set_sampled(cache, row_index) ) {
+		return;
+	}
+	__builtin_prefetch(cache->wide ? (const void*)&cache->wide_tags[(size_t)row_index * cache->ways] :
+		(const void*)&cache->tags[(size_t)row_index * cache->ways]);
+	__builtin_prefetch(&cache->valid[(size_t)row_index * cache->mask_words]);
+	if( access->type == Access_D_WRITE ) {
+		__builtin_prefetch(&cache->dirty[(size_t)row_index * cache->mask_words], 1);
+	}
+	if( cache->repl_stride != 0 ) {
+		__builtin_prefetch(cache->repl_state + (size_t)row_index * cache->repl_stride, 1);
+	}
+	if( cache->shadow.size != 0 ) {	// the shadow cache's index is as scattered as the sets
+		__builtin_prefetch(&cache->shadow.index[table_slot(block_number(cache, row_index, tag), cache->shadow.index_size)]);
+	}
+}
+
+static inline void simulate_access(cachesim_t* sim, const struct Access* access) {
+	struct Cache* cache = cache_for(sim, access->type);
+	cache->access(cache, access->type, access->address);
+}
+
+/* simulates accesses[0..n), all of them */
+static void access_run(cachesim_t* sim, const struct Access* accesses, size_t n) {
+	int prefetch_i = sim->icache.storage_size >= PREFETCH_MIN_BYTES;
+	int prefetch_d = sim->dcache.storage_size >= PREFETCH_MIN_BYTES;
+
+	if( !prefetch_i && !prefetch_d ) {
+		for( size_t i = 0; i < n; i++ ) {
+			simulate_access(sim, &accesses[i]);
+		}
+		return;
+	}
+
+	for( size_t i = 0; i < n; i++ ) {
+		if( i + PREFETCH_DISTANCE < n ) {
+			const struct Access* ahead = &accesses[i + PREFETCH_DISTANCE];
+			if( ahead->type == Access_I_FETCH ? prefetch_i : prefetch_d ) {
+				prefetch_set(cache_for(sim, ahead->type), ahead);
+			}
+		}
+		simulate_access(sim, &accesses[i]);
+	}
+}
+
+/*
+Sampling. Set sampling is done by the access kernels, which drop an access to
+a set outside the sample as soon as it is decoded (see set_sampled). Time
+sampling splits the trace into periods of sample_period accesses: the first
+ones are skipped, the next sample_warmup simulated with the counters put back
+afterwards, so they only warm the caches, and the last sample_window, the
+window, counted. Either way the counters only cover the sample, and the miss
+rate they give, a ratio of two sums over sets or windows, comes with a
+confidence interval from the usual ratio estimator for cluster samples,
+with sets or windows as the clusters:
+	var(r) = (1 - f) / (n * mean(a)^2) * sum((m - r * a)^2) / (n - 1)
+for n samples with a accesses and m misses each, a fraction f of all of them.
+*/
+#define CONFIDENCE_Z 1.96	/* 95% */
+
+static uint64_t stats_accesses(const struct Stats* stats) {
+	return stats->reads + stats->writes;
+}
+
+static uint64_t stats_misses(const struct Stats* stats) {
+	return stats->compulsory_miss + stats->conflict_miss + stats->capacity_miss;
+}
+
+static void window_begin(struct Cache* cache) {
+	cache->windows.start_accesses = stats_accesses(&cache->stats);
+	cache->windows.start_misses = stats_misses(&cache->stats);
+}
+
+static void window_end(struct Cache* cache) {
+	struct WindowSums* sums = &cache->windows;
+	double accesses = (double)(stats_accesses(&cache->stats) - sums->start_accesses);
+	double misses = (double)(stats_misses(&cache->stats) - sums->start_misses);
+
+	sums->windows++;
+	sums->accesses += accesses;
+	sums->misses += misses;
+	sums->accesses_squared += accesses * accesses;
+	sums->misses_squared += misses * misses;
+	sums->products += accesses * misses;
+}
+
+/* runs accesses[0..n) through the periods, starting at sim->clock */
+static void time_sampled_run(cachesim_t* sim, const struct Access* accesses, size_t n) {
+	uint64_t skip = sim->sample_period - sim->sample_window - sim->sample_warmup;
+	uint64_t window = skip + sim->sample_warmup;	// where it starts
+
+	while( n > 0 ) {
+		uint64_t phase = sim->clock % sim->sample_period;
+		uint64_t left = phase < skip ? skip - phase : phase < window ? window - phase : sim->sample_period - phase;
+		size_t run = left < n ? (size_t)left : n;
+
+		if( phase >= window ) {
+			if( phase == window ) {
+				window_begin(&sim->icache);
+				window_begin(&sim->dcache);
+			}
+			access_run(sim, accesses, run);
+			if( run == left ) {
+				window_end(&sim->icache);
+				window_end(&sim->dcache);
+			}
+		} else if( phase >= skip ) {
+			struct Stats icache = sim->icache.stats;
+			struct Stats dcache = sim->dcache.stats;
+			access_run(sim, accesses, run);
+			sim->icache.stats = icache;
+			sim->dcache.stats = dcache;
+		}
+		sim->clock += run;
+		accesses += run;
+		n -= run;
+	}
+}
+
+void cachesim_access_batch(cachesim_t* sim, const struct Access* accesses, size_t n) {
+	if( sim->sample_period != 0 ) {
+		time_sampled_run(sim, accesses, n);
+	} else {
+		access_run(sim, accesses, n);
+	}
+}
+
+int cachesim_estimate(const cachesim_t* sim, AccessType type, struct MissEstimate* estimate) {
+	const struct Cache* cache = (type == Access_I_FETCH) ? &sim->icache : &sim->dcache;
+	uint64_t accesses = stats_accesses(&cache->stats);
+	double rate = accesses ? (double)stats_misses(&cache->stats) / (double)accesses : 0;
+	double n = 0, squares = 0, total = 0, fraction;
+
+	if( cache->num_sets == 0 || (sim->sample_period == 0 && cache->sample_limit == 0) ) {
+		return 0;
+	}
+	if( sim->sample_period != 0 ) {
+		const struct WindowSums* sums = &cache->windows;
+		n = (double)sums->windows;
+		squares = sums->misses_squared - 2 * rate * sums->products + rate * rate * sums->accesses_squared;
+		total = sums->accesses;
+		fraction = (double)sim->sample_window / (double)sim->sample_period;
+	} else {
+		for( int row = 0; row < cache->num_sets; row++ ) {
+			const struct SetStats* set = &cache->inst.sets[row];
+			if( set_sampled(cache, row) ) {
+				double miss_error = (double)set->misses - rate * (double)set->accesses;
+				n++;
+				squares += miss_error * miss_error;
+				total += (double)set->accesses;
+			}
+		}
+		fraction = n / cache->num_sets;
+	}
+	estimate->miss_rate = rate;
+	estimate->samples = (uint64_t)n;
+	estimate->error = -1;
+	if( n >= 2 && total > 0 ) {
+		double mean = total / n;
+		estimate->error = CONFIDENCE_Z * sqrt((1 - fraction) / (n * mean * mean) * (squares > 0 ? squares : 0) / (n - 1));
+	}
+	return 1;
+}
+
+/* Handles *********************************************************************/
+
+cachesim_t* cachesim_create(const CacheInfo* icache_info, const CacheInfo* dcache_info,
+	const struct cachesim_options* options, const char** error) {
+	cachesim_t* sim = calloc(1, sizeof(cachesim_t));
+	struct cachesim_options defaults = { 0 };
+	const char* problem;
+
+	if( options == NULL ) {
+		options = &defaults;
+	}
+	if( sim == NULL ) {
+		problem = "Out of memory allocating the cache.";
+	} else if( options->address_bits < 0 || options->address_bits > 64 ) {
+		problem = "Addresses can be at most 64 bits wide.";
+	} else if( options->sample_window != 0 &&
+		(options->sample_period < options->sample_window ||
+		options->sample_period - options->sample_window < options->sample_warmup) ) {
+		problem = "A time sampling period has to hold its window and warm-up.";
+	} else {
+		sim->seed = options->seed;
+		if( options->sample_window != 0 ) {
+			sim->sample_window = options->sample_window;
+			sim->sample_period = options->sample_period;
+			sim->sample_warmup = options->sample_warmup;
+		}
+		problem = cache_setup(&sim->icache, icache_info, options, 0);
+		if( problem == NULL ) {	// only L1 of the d-cache is simulated
+			problem = cache_setup(&sim->dcache, &dcache_info[0], options, 1);
+		}
+	}
+	if( problem == NULL ) {
+		sim->arena_size = sim->icache.storage_size + sim->dcache.storage_size;
+		sim->backing = "no pages";
+		if( sim->arena_size != 0 ) {
+			sim->arena = arena_map(sim->arena_size, !options->small_pages,
+				&sim->arena_mapped, &sim->backing);
+			if( sim->arena == NULL ) {
+				problem = "Out of memory allocating the cache.";
+			} else {
+				cache_place(&sim->icache, sim->arena);
+				cache_place(&sim->dcache, (char*)sim->arena + sim->icache.storage_size);
+			}
+		}
+	}
+	if( problem != NULL ) {
+		if( error != NULL ) {
+			*error = problem;
+		}
+		cachesim_destroy(sim);
+		return NULL;
+	}
+
+	cache_seed(&sim->icache, sim->seed);
+	cache_seed(&sim->dcache, ~sim->seed);
+	return sim;
+}
+
+void cachesim_get_stats(const cachesim_t* sim, struct Stats* icache, struct Stats* dcache) {
+	if( icache != NULL ) {
+		*icache = sim->icache.stats;
+	}
+	if( dcache != NULL ) {
+		*dcache = sim->dcache.stats;
+	}
+}
+
+void cachesim_metrics(const struct Stats* stats, uint64_t instructions, struct Metrics* metrics) {
+	uint64_t misses = stats_misses(stats);
+
+	metrics->accesses = stats_accesses(stats);
+	metrics->misses = misses;
+	metrics->read_misses = misses - stats->write_misses;
+	metrics->miss_rate = metrics->accesses ? (double)misses / metrics->accesses : 0;
+	metrics->miss_rate_without_compulsory = metrics->accesses ?
+		(double)(misses - stats->compulsory_miss) / metrics->accesses : 0;
+	metrics->read_miss_rate = stats->reads ? (double)metrics->read_misses / stats->reads : 0;
+	metrics->write_miss_rate = stats->writes ? (double)stats->write_misses / stats->writes : 0;
+	metrics->mpki = instructions ? misses * 1000.0 / instructions : 0;
+	metrics->traffic_bytes = (stats->mem_reads + stats->words_written_to_mem) * 4;
+}
+
+void cachesim_reset(cachesim_t* sim) {
+	sim->clock = 0;
+	cache_clear(&sim->icache);
+	cache_clear(&sim->dcache);
+	cache_seed(&sim->icache, sim->seed);
+	cache_seed(&sim->dcache, ~sim->seed);
+}
+
+void cachesim_reset_stats(cachesim_t* sim) {
+	cache_clear_stats(&sim->icache);
+	cache_clear_stats(&sim->dcache);
+}
+
+void cachesim_destroy(cachesim_t* sim) {
+	if( sim == NULL ) {
+		return;
+	}
+	if( sim->owner == NULL && sim->arena != NULL ) {
+		munmap(sim->arena, sim->arena_mapped);
+	}
+	if( sim->owner == NULL ) {
+		seen_destroy(sim->icache.shadow.seen);
+		seen_destroy(sim->dcache.shadow.seen);
+	}
+	free(sim);
+}
+
+size_t cachesim_footprint(const cachesim_t* sim, const char** backing) {
+	if( backing != NULL ) {
+		*backing = sim->backing;
+	}
+	return sim->arena_size;
+}
+
+int cachesim_num_sets(const cachesim_t* sim, AccessType type) {
+	return (type == Access_I_FETCH) ? sim->icache.num_sets : sim->dcache.num_sets;
+}
+
+int cachesim_set_of(const cachesim_t* sim, AccessType type, memaddr_t address) {
+	const struct Cache* cache = (type == Access_I_FETCH) ? &sim->icache : &sim->dcache;
+	int row_index;
+	memaddr_t tag;
+
+	if( cache->num_sets == 0 ) {
+		return -1;
+	}
+	decode_address(&cache->decoder, address, &tag, &row_index);
+	return row_index;
+}
+
+int cachesim_set_stats(const cachesim_t* sim, AccessType type, const struct SetStats** sets) {
+	const struct Cache* cache = (type == Access_I_FETCH) ? &sim->icache : &sim->dcache;
+
+	*sets = cache->inst.sets;
+	return (cache->inst.sets != NULL) ? cache->num_sets : 0;
+}
+
+static int by_misses(const void* a, const void* b) {
+	const struct HotBlock* x = a;
+	const struct HotBlock* y = b;
+
+	if( x->misses != y->misses ) {
+		return (x->misses < y->misses) ? 1 : -1;
+	}
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+int cachesim_hot_blocks(const cachesim_t* sim, AccessType type, struct HotBlock* blocks, int max) {
+	const struct Cache* cache = (type == Access_I_FETCH) ? &sim->icache : &sim->dcache;
+	const struct Instrumentation* inst = &cache->inst;
+	struct HotBlock* all;
+	int n = inst->top_used;
+
+	if( n == 0 || max <= 0 ) {
+		return 0;
+	}
+	all = malloc(n * sizeof(struct HotBlock));
+	if( all == NULL ) {
+		return 0;
+	}
+	for( int i = 0; i < n; i++ ) {
+		all[i].address = inst->top_blocks[i] << cache->decoder.row_shift;
+		all[i].misses = inst->top_misses[i];
+		all[i].error = inst->top_errors[i];
+	}
+	qsort(all, n, sizeof(struct HotBlock), by_misses);
+	if( n > max ) {
+		n = max;
+	}
+	memcpy(blocks, all, n * sizeof(struct HotBlock));
+	free(all);
+	return n;
+}
+
+cachesim_t* cachesim_share(cachesim_t* sim) {
+	cachesim_t* view = malloc(sizeof(cachesim_t));
+
+	if( view == NULL ) {
+		return NULL;
+	}
+	*view = *sim;
+	view->owner = sim;
+	memset(&view->icache.stats, 0, sizeof(struct Stats));
+	memset(&view->dcache.stats, 0, sizeof(struct Stats));
+	return view;
+}
+
+static void add_stats(struct Stats* total, const struct Stats* part) {
+	total->reads += part->reads;
+	total->writes += part->writes;
+	total->mem_reads += part->mem_reads;
+	total->words_written_to_mem += part->words_written_to_mem;
+	total->compulsory_miss += part->compulsory_miss;
+	total->conflict_miss += part->conflict_miss;
+	total->capacity_miss += part->capacity_miss;
+	total->write_misses += part->write_misses;
+	total->prefetches += part->prefetches;
+	total->useful_prefetches += part->useful_prefetches;
+	total->late_prefetches += part->late_prefetches;
+	total->polluting_prefetches += part->polluting_prefetches;
+	total->victim_hits += part->victim_hits;
+	total->write_buffer_merges += part->write_buffer_merges;
+}
+
+void cachesim_join(cachesim_t* view) {
+	add_stats(&view->owner->icache.stats, &view->icache.stats);
+	add_stats(&view->owner->dcache.stats, &view->dcache.stats);
+	free(view);
+}
+
+/* Checkpoints *****************************************************************/
+
+/*
+A checkpoint is the handle's whole state in one file: a header holding both
+caches' structures, which carry their counters, generators and the small
+fixed tables of prefetchers and the like, then the arena, starting on a
+CHECKPOINT_ALIGN boundary so it can be mapped straight from the file, then the
+block sets of 3C classification. Everything is in the host's byte order and
+layout, so a checkpoint is for the build that wrote it, which the header checks
+as well as it can. Restoring maps the arena copy-on-write where it can, so
+any number of runs can start from one warm checkpoint without copying it.
+*/
+#define CHECKPOINT_MAGIC "CSCK"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_BYTE_ORDER 0x01020304u
+#define CHECKPOINT_ALIGN ((uint64_t)1 << 16)	/* a page, whatever the page size */
+
+struct CheckpointHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t cache_bytes;	/* sizeof(struct Cache) */
+	struct TracePosition position;
+	uint64_t clock;
+	uint64_t sample_window;
+	uint64_t sample_period;
+	uint64_t sample_warmup;
+	uint64_t arena_offset;
+	uint64_t arena_size;
+	uint64_t seen_size[2];	/* groups in each cache's block set, 0 if it has none */
+	uint64_t seen_used[2];
+	struct Cache icache;	/* the pointers in them mean nothing */
+	struct Cache dcache;
+};
+
+/* whether a checkpointed cache was set up like this one */
+static int same_configuration(const struct Cache* a, const struct Cache* b) {
+	return a->num_sets == b->num_sets && a->ways == b->ways && a->words_per_block == b->words_per_block &&
+		a->replacement == b->replacement && a->write_scheme == b->write_scheme &&
+		a->allocate_scheme == b->allocate_scheme && a->decoder.tag_shift == b->decoder.tag_shift &&
+		a->decoder.tag_mask == b->decoder.tag_mask && a->storage_size == b->storage_size &&
+		a->pf.info.type == b->pf.info.type && a->pf.info.degree == b->pf.info.degree &&
+		a->pf.info.distance == b->pf.info.distance && a->pf.latency == b->pf.latency &&
+		a->victim.size == b->victim.size && a->wbuf.size == b->wbuf.size &&
+		a->inst.per_set == b->inst.per_set && a->inst.top == b->inst.top &&
+		a->shadow.size == b->shadow.size && a->sample_limit == b->sample_limit;
+}
+
+/* takes on a checkpointed cache's state, keeping what belongs to this
+process: its kernels, block set and storage, the arrays of which are already
+in storage */
+static void cache_restore(struct Cache* cache, const struct Cache* saved, void* storage) {
+	struct Cache live = *cache;
+
+	if( cache->storage_size == 0 ) {
+		return;
+	}
+	*cache = *saved;
+	if( live.wide ) {
+		cache->wide_probe = live.wide_probe;
+	} else {
+		cache->probe = live.probe;
+	}
+	cache->access = live.access;
+	cache->policy = live.policy;
+	cache->shadow.seen = live.shadow.seen;
+	cache_point(cache, storage);
+}
+
+static size_t seen_groups(const struct Cache* cache) {
+	return cache->shadow.seen ? cache->shadow.seen->size : 0;
+}
+
+const char* cachesim_save(const cachesim_t* sim, const char* path, const struct TracePosition* position) {
+	struct CheckpointHeader* header = calloc(1, sizeof(struct CheckpointHeader));
+	const struct Cache* caches[2] = { &sim->icache, &sim->dcache };
+	FILE* out;
+	int ok;
+
+	if( header == NULL ) {
+		return "Out of memory writing the checkpoint.";
+	}
+	memcpy(header->magic, CHECKPOINT_MAGIC, 4);
+	header->version = CHECKPOINT_VERSION;
+	header->byte_order = CHECKPOINT_BYTE_ORDER;
+	header->cache_bytes = sizeof(struct Cache);
+	header->position = *position;
+	header->clock = sim->clock;
+	header->sample_window = sim->sample_window;
+	header->sample_period = sim->sample_period;
+	header->sample_warmup = sim->sample_warmup;
+	header->arena_offset = (sizeof(struct CheckpointHeader) + CHECKPOINT_ALIGN - 1) & ~(CHECKPOINT_ALIGN - 1);
+	header->arena_size = sim->arena_size;
+	header->icache = sim->icache;
+	header->dcache = sim->dcache;
+	for( int c = 0; c < 2; c++ ) {
+		header->seen_size[c] = seen_groups(caches[c]);
+		header->seen_used[c] = header->seen_size[c] ? caches[c]->shadow.seen->used : 0;
+	}
+
+	out = fopen(path, "wb");
+	if( out == NULL ) {
+		free(header);
+		return "Could not create the checkpoint file.";
+	}
+	ok = fwrite(header, sizeof(struct CheckpointHeader), 1, out) == 1 &&
+		fseeko(out, (off_t)header->arena_offset, SEEK_SET) == 0 &&
+		(sim->arena_size == 0 || fwrite(sim->arena, sim->arena_size, 1, out) == 1);
+	for( int c = 0; c < 2 && ok; c++ ) {
+		if( header->seen_size[c] != 0 ) {
+			ok = fwrite(caches[c]->shadow.seen->groups, sizeof(struct SeenGroup), header->seen_size[c], out) ==
+				header->seen_size[c];
+		}
+	}
+	free(header);
+	if( fclose(out) != 0 || !ok ) {
+		return "Could not write the checkpoint file.";
+	}
+	return NULL;
+}
+
+/* reads a cache's block set into a new table of groups groups, replacing its
+own once the whole checkpoint has checked out */
+static struct SeenGroup* seen_read(FILE* in, uint64_t groups) {
+	struct SeenGroup* table;
+
+	if( groups == 0 ) {
+		return NULL;
+	}
+	table = malloc(groups * sizeof(struct SeenGroup));
+	if( table != NULL && fread(table, sizeof(struct SeenGroup), groups, in) != groups ) {
+		free(table);
+		table = NULL;
+	}
+	return table;
+}
+
+/* the arena of a checkpoint, mapped copy-on-write, or read into the handle's
+own arena if the file can't be mapped. Returns 0 if it can't be read at all */
+static int arena_restore(cachesim_t* sim, FILE* in, const struct CheckpointHeader* header) {
+	void* arena;
+
+	if( header->arena_size == 0 ) {
+		return 1;
+	}
+	arena = mmap(NULL, header->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(in),
+		(off_t)header->arena_offset);
+	if( arena != MAP_FAILED ) {
+		munmap(sim->arena, sim->arena_mapped);
+		sim->arena = arena;
+		sim->arena_mapped = header->arena_size;
+		sim->backing = "a checkpoint file";
+		return 1;
+	}
+	return fseeko(in, (off_t)header->arena_offset, SEEK_SET) == 0 &&
+		fread(sim->arena, header->arena_size, 1, in) == 1;
+}
+
+const char* cachesim_restore(cachesim_t* sim, const char* path, struct TracePosition* position) {
+	struct CheckpointHeader* header = malloc(sizeof(struct CheckpointHeader));
+	struct Cache* caches[2] = { &sim->icache, &sim->dcache };
+	struct SeenGroup* seen[2] = { NULL, NULL };
+	const char* problem = NULL;
+	FILE* in = fopen(path, "rb");
+
+	if( header == NULL ) {
+		problem = "Out of memory reading the checkpoint.";
+	} else if( in == NULL ) {
+		problem = "Could not open the checkpoint file.";
+	} else if( sim->owner != NULL ) {
+		problem = "Only a handle of its own can be restored, not a view.";
+	} else if( fread(header, sizeof(struct CheckpointHeader), 1, in) != 1 ||
+		memcmp(header->magic, CHECKPOINT_MAGIC, 4) != 0 || header->version != CHECKPOINT_VERSION ||
+		header->byte_order != CHECKPOINT_BYTE_ORDER || header->cache_bytes != sizeof(struct Cache) ) {
+		problem = "Not a checkpoint this build of the simulator wrote.";
+	} else if( !same_configuration(&header->icache, &sim->icache) ||
+		!same_configuration(&header->dcache, &sim->dcache) || header->arena_size != sim->arena_size ||
+		header->sample_window != sim->sample_window || header->sample_period != sim->sample_period ||
+		header->sample_warmup != sim->sample_warmup ) {
+		problem = "The checkpoint is of differently configured caches.";
+	} else if( fseeko(in, (off_t)(header->arena_offset + header->arena_size), SEEK_SET) != 0 ||
+		((seen[0] = seen_read(in, header->seen_size[0])) == NULL && header->seen_size[0] != 0) ||
+		((seen[1] = seen_read(in, header->seen_size[1])) == NULL && header->seen_size[1] != 0) ) {
+		problem = "Could not read the checkpoint file.";
+	} else if( !arena_restore(sim, in, header) ) {
+		problem = "Could not read the checkpoint file.";
+		cachesim_reset(sim);	// its arena is half overwritten
+	}
+
+	if( problem == NULL ) {
+		cache_restore(&sim->icache, &header->icache, sim->arena);
+		cache_restore(&sim->dcache, &header->dcache, (char*)sim->arena + sim->icache.storage_size);
+		for( int c = 0; c < 2; c++ ) {
+			struct SeenBlocks* blocks = caches[c]->shadow.seen;
+			if( blocks != NULL ) {
+				free(blocks->groups);
+				blocks->groups = seen[c];
+				blocks->size = header->seen_size[c];
+				blocks->used = header->seen_used[c];
+			}
+		}
+		sim->clock = header->clock;
+		if( position != NULL ) {
+			*position = header->position;
+		}
+	} else {
+		free(seen[0]);
+		free(seen[1]);
+	}
+	if( in != NULL ) {
+		fclose(in);
+	}
+	free(header);
+	return problem;
+}